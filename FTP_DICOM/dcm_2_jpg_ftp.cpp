@@ -2,13 +2,32 @@
 The image is uploaded to the server, via FTP protocol.
 Image is in dicom format and is converted to JPEG format before uploading.
 Uploaded image can be viewed by typing the URL on any browser.
-Uses the dcm library to convert the dcm image to JPEG.
+Uses the dcm library to convert the dcm image to JPEG, in-process and straight into memory.
 The FTP uploading happends via the AT commands that are executed on the GSM board which can be connected to the Pi via serial port.
 */
 #include "dcmtk/config/osconfig.h"
 #include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/dcmdata/dcrledrg.h"
+#include "dcmtk/dcmdata/dcpixel.h"
+#include "dcmtk/dcmdata/dcpixseq.h"
+#include "dcmtk/dcmdata/dcpxitem.h"
+#include "dcmtk/dcmimgle/dcmimage.h"
+#include "dcmtk/dcmimage/diregist.h"
+#include "dcmtk/dcmjpeg/djdecode.h"
 
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <map>
+#include <string>
+#include <memory>
+#include <future>
+#include <functional>
 using namespace std;
 
 #include <bcm2835.h>
@@ -22,524 +41,3877 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+// vector unit for the windowing kernel, picked at compile time
+// (Pi 3/4 with -mfpu=neon or aarch64, x86 gateways with -msse2 / -mavx2)
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Serial read write functions
 int  uart_write();
 int  uart_read_OK();
-int  uart_read_MSG();
-int  uart_read_FTPPUT(const char *);
 int  uart_read_gen();
-int  uart_write_tmp(int size);
+int  uart_write_tmp(const unsigned char *, size_t);
 int  uart_read_temp();
+int  uart_read_urc(int, int *, int secs = -1);
+int  uart_read_reply(int, int);
+
+// bytes read from the modem and not consumed yet, filled a burst at a time
+const unsigned uart_ring_size = 4096;
+struct uart_ring {
+	unsigned char buf[uart_ring_size];
+	unsigned head, tail;		// free running, head == tail when empty
+};
+
+// replies the byte readers look for, result codes and the URC prefixes, matched together
+// in one pass
+enum { TOK_OK, TOK_ERROR, TOK_FAIL, TOK_CONNECT, TOK_CLOSED, TOK_FTPPUT, TOK_FTPSIZE, TOK_CMGS, TOK_HTTPACTION, TOK_COUNT };
+struct reply_matcher {
+	vector<vector<int16_t> > next;	// state x byte -> state
+	vector<unsigned> out;			// tokens ending in a state, bit per token
+};
+
+// AT engine of a modem: a thread on epoll owns the port's input. Commands queue up and go
+// out one at a time, each with a deadline, and complete through a callback or a future.
+// Unsolicited result codes go to the handler registered for their prefix, the rest of the
+// input is passed on to the byte readers above.
+enum { AT_OK = 0, AT_ERROR = 1, AT_TIMEOUT = 2, AT_CLOSED = 3 };
+
+struct at_result {
+	int status;
+	vector<string> lines;			// reply lines, the final result code included
+};
+
+struct at_request {
+	string cmd;						// the frame, CR included
+	int    ms;						// deadline, from when it goes out
+	bool   quiet;					// reply only to the result, not to the byte readers
+	bool   one_line;				// no final result code, the first line or a "> " prompt is the reply
+	thread::id from;
+	function<void(const at_result &)> done;
+};
+
+struct at_engine {
+	int    fd, wake, ep;			// port, eventfd, epoll
+	thread th;
+	mutex  mtx;
+	condition_variable readable;	// input for the byte readers
+	deque<at_request> cmds;			// the front one is out when busy
+	bool   busy;
+	at_result res;					// of the command that is out
+	long long deadline;				// ms, CLOCK_MONOTONIC
+	uart_ring out;					// input the byte readers haven't taken
+	size_t overrun;					// bytes of it dropped on a full ring, reported by the next read
+	string line;					// line being received
+	size_t released;				// bytes of it passed on, the rest may be a URC
+	vector<pair<string, function<void(const string &)> > > urcs;
+	int    hold;					// a data transfer has the port, only the holder's commands go out
+	thread::id holder;
+	bool   dead, stop;
+	atomic<int> bearer_lost, ip_lost, restarted;	// set by URC handlers, taken by the modem's thread
+	FILE  *trace;					// serial trace of the port, -T
+};
+
+at_engine *at_start(int, FILE *);
+void at_stop(at_engine *);
+int  at_submit(at_engine *, const string &, int, function<void(const at_result &)>, bool quiet = true, bool one_line = false);
+future<at_result> at_command(at_engine *, const string &, int, bool one_line = false);
+void at_on_urc(at_engine *, const char *, function<void(const string &)>);
+void at_hold(at_engine *, int);
+
+// one line of an AT script: the frame, CR included, and the reply that completes it
+struct at_step {
+	const char *frame;
+	size_t      len;
+	const char *expect;
+	int         secs;
+	bool        one_line;	// the reply is one line without a result code (AT+CIFSR, DOWNLOAD, "> ")
+};
+
+// serial trace of a modem (-T): trace_magic, then a record for every read and write of the
+// port from when it is opened, each followed by its bytes. Host byte order.
+// MODEM_EMULATOR -R plays it back.
+struct trace_rec {
+	uint32_t ms;		// CLOCK_MONOTONIC, only the difference between records counts
+	uint16_t len;
+	uint8_t  dir;		// TRACE_RX from the modem, TRACE_TX to it
+	uint8_t  spare;
+};
+enum { TRACE_RX, TRACE_TX };
+FILE *trace_open(const char *);
+void  trace_bytes(FILE *, int, const void *, size_t);
+
+// frame and length of a literal, both known at compile time
+#define AT_FRAME(s)	s, sizeof(s) - 1
+
+int  run_script(const at_step *, size_t);
+at_step at_step_fmt(char *, size_t, const char *, int, bool, const char *, ...);
+
+// in-memory image, produced by the conversion and consumed by the uploader
+struct mem_buf {
+	unsigned char *data;
+	size_t         size;
+};
+
+// notification and routing fields of a study, read without the pixel data
+struct study_info {
+	OFString patientName;
+	OFString patientID;
+	OFString modality;
+	OFString studyDate;
+	OFString studyDescription;
+	OFString accessionNumber;
+	OFString studyUID;
+	OFString seriesUID;
+	OFString sopInstanceUID;
+	OFString priority;			// Requested Procedure Priority, STAT / HIGH / ROUTINE ..
+	Uint16   rows;
+	Uint16   columns;
+	long     frames;
+};
+
+// read the study info, parsing stops at the pixel data
+int  read_study_info(const char *, study_info *);
+void get_study_info(DcmDataset *, study_info *);
+
+// VOI windowing / rescale of 16 bit monochrome pixels to 8 bit. Slope, intercept,
+// window and inversion are folded into one fixed point linear map:
+//   u = stored value (sign extended and biased by 0x8000 when signed)
+//   y = clamp(((min(u - lo, span) * mul) + add) >> frac, 0, 255)
+// so the SIMD kernels and the scalar reference give identical output.
+struct voi_map {
+	Uint16 mask;		// stored bits, unsigned data
+	int    shift;		// 16 - bits stored, sign extension of signed data
+	int    is_signed;
+	Uint16 lo;			// last value below the window (biased)
+	Uint16 span;		// first saturating value - lo
+	Uint32 mul;			// fixed point slope, fits 16 bits
+	Sint32 add;			// fixed point output at lo, plus rounding
+	int    frac;		// fixed point fraction bits
+	int    invert;		// MONOCHROME1 / negative slope
+};
+
+int  setup_voi_map(voi_map *, int, int, double, double, double, double, int);
+void voi_rescale_scalar(const voi_map *, const Uint16 *, unsigned char *, size_t);
+void voi_rescale(const voi_map *, const Uint16 *, unsigned char *, size_t);
+
+// render a frame to 8 bit with the kernel above, and encode 8 bit pixels to JPEG
+int  render_mono_8bit(DcmDataset *, unsigned long, mem_buf *, int *, int *);
+int  encode_jpeg(const unsigned char *, int, int, int, int, unsigned int, int, mem_buf *);
+
+// encode large images as horizontal bands on all cores, stitched at restart markers
+int  encode_jpeg_parallel(const unsigned char *, int, int, int, int, int, mem_buf *);
+
+// small preview of a finished JPEG, uploaded ahead of the full image
+int  make_preview(const mem_buf *, mem_buf *);
+
+// encode profile: what a study may cost on the GPRS link. The encoder searches quality,
+// then halves the resolution, until the JPEG fits the byte budget.
+struct encode_profile {
+	const char *name;
+	long   target_bytes;	// byte budget, 0 for none
+	double max_seconds;		// or transfer time budget, 0 for none ..
+	double link_rate;		// .. at this rate (bytes/s) until an upload has measured one
+	int    min_quality;
+	int    max_quality;
+	int    max_downscale;	// halve the resolution up to this many times
+	int    crop;			// trim flat borders (collimation, scanner background) first
+};
+
+// what the profile search settled on
+struct encode_result {
+	int    quality;
+	int    downscale;
+	int    width;
+	int    height;
+	long   budget;
+	double seconds;			// estimated transfer time
+};
+
+const encode_profile *find_profile(const char *);
+long profile_budget(const encode_profile *);
+int  encode_profiled(const unsigned char *, int, int, int, const encode_profile *, mem_buf *, encode_result *);
 
 // convert image format
-int  convert_dcm_2_jpg();
+int  convert_dcm_2_jpg(const char *, mem_buf *);
+int  convert_frame(DcmFileFormat *, unsigned long, mem_buf *);
+
+// frames of a multi-frame object to convert
+struct frame_select {
+	long first;			// first frame, 0 based
+	long last;			// last frame, -1 for the end
+	long step;			// every Nth frame
+	int  key_only;		// only the representative frame and the frames of interest
+};
+
+// gets each converted frame in turn, the buffer is freed when it returns
+typedef int (*frame_sink)(unsigned long, const mem_buf *, void *);
+
+// convert a multi-frame object one frame at a time
+int  convert_dcm_frames(const char *, const frame_select *, frame_sink, void *);
+int  upload_frame(unsigned long, const mem_buf *, void *);
+
+// where upload_frame() puts the frames
+struct frame_upload {
+	const char *base;		// remote name without extension
+	int         previews;	// frames still to be previewed
+};
+
+
+// copy out an already JPEG compressed frame, without decoding it
+bool is_jpeg_passthrough(DcmDataset *);
+int  extract_jpeg_frame(DcmDataset *, unsigned long, mem_buf *);
+
+// send sms, split in concatenated parts when longer than one
+int  send_sms(const char *);
+
+// completed studies waiting for the next notification SMS
+struct sms_batch {
+	vector<string> studies;		// Study Instance UIDs, in completion order
+	map<string, string> text;	// patient, modality, date of each
+	map<string, int> files;
+	time_t first;				// when the oldest one completed
+	time_t retry;				// no new try before this, after a send failed
+	size_t sending;				// studies of the message out now, 0 when none
+	mutex  mtx;
+};
+
+void notify_study(const string &, const string &);
+bool take_notices(string *, int);
+void notices_sent(int);
 
-// send sms
-void send_sms();
+// upload buffer through FTP to server, resuming after a dropped session
+int  upload_file(const char *, const mem_buf *);
+int  open_bearer();
+int  ftp_login();
+int  ftp_open(const char *, size_t);
+long ftp_remote_size(const char *);
+int  ftp_send(const mem_buf *, size_t *);
+void update_link_rate(size_t, const struct timespec *);
 
-// upload file through FTP to server
-void upload_file();
+// the same upload over the modem's TCP/IP stack, raw TCP or HTTP POST
+int  tcp_upload(const char *, const mem_buf *);
+int  http_upload(const char *, const mem_buf *);
+int  open_ip_stack();
+
+// how files get to the server, picked with -t
+struct transport {
+	const char *name;
+	int (*put)(const char *, const mem_buf *);	// remote name, data; -1 on failure
+};
+const transport *find_transport(const char *);
+
+// preview first (when enabled), then the full image
+int  deliver_jpeg(const char *, const mem_buf *, int);
+
+// bounded FIFO between the watch mode stages: push blocks while full, which holds the
+// converters back when the modem falls behind. pop returns false once closed and empty.
+// With 'before', an element goes ahead of the first queued one it ranks before.
+template <class T> class bounded_queue {
+public:
+	bounded_queue(size_t cap, bool (*before)(const T &, const T &) = NULL) : cap(cap), closed(false), before(before) {}
+	
+	bool push(const T &v) {
+		unique_lock<mutex> lock(mtx);
+		not_full.wait(lock, [this] { return q.size() < cap || closed; });
+		if(closed) return false;
+		typename deque<T>::iterator it = q.end();
+		if(before)
+			for(it = q.begin(); it != q.end() && !before(v, *it); ++it) ;
+		q.insert(it, v);
+		not_empty.notify_one();
+		return true;
+	}
+	
+	bool pop(T &v) {
+		unique_lock<mutex> lock(mtx);
+		not_empty.wait(lock, [this] { return !q.empty() || closed; });
+		if(q.empty()) return false;
+		v = q.front();
+		q.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+	
+	// 1 with an element, 0 when nothing came within ms, -1 once closed and empty
+	int pop_wait(T &v, int ms) {
+		unique_lock<mutex> lock(mtx);
+		if(!not_empty.wait_for(lock, chrono::milliseconds(ms), [this] { return !q.empty() || closed; })) return 0;
+		if(q.empty()) return -1;
+		v = q.front();
+		q.pop_front();
+		not_full.notify_one();
+		return 1;
+	}
+	
+	void close() {
+		lock_guard<mutex> lock(mtx);
+		closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+	
+private:
+	deque<T>           q;
+	size_t             cap;
+	bool               closed;
+	bool             (*before)(const T &, const T &);
+	mutex              mtx;
+	condition_variable not_full, not_empty;
+};
+
+// converted image on its way to the modem
+struct upload_job {
+	uint64_t qid;		// work_queue entry
+	int     priority;
+	string  src;		// spool file it came from
+	string  name;		// remote name, no extension
+	string  study;		// Study Instance UID, bundling key
+	string  notice;		// patient, modality, date for the notification SMS
+	mem_buf jpg;		// NULL for the closing job of a multi-frame file
+	int     preview;
+	int     last;		// last job of src, the file can be retired after it
+	int     failed;		// conversion failed
+	int     skipped;	// already uploaded before, nothing to do
+	int     has_keys;	// dedup keys below are valid
+	uint64_t uid_hash;
+	uint64_t content_hash;
+};
+
+// STAT jobs overtake routine ones in the upload queue
+bool upload_before(const upload_job &, const upload_job &);
+
+// images of one study on their way to the server as a single tar
+struct study_bundle {
+	vector<upload_job> parts;
+	size_t bytes;
+};
+
+// a GSM modem of the watch mode, driven by its own thread
+struct modem {
+	string dev;
+	int    fails;			// failed uploads in a row
+	long   uploads;
+	size_t bytes;
+	double seconds;
+};
+
+int  open_modem(const char *);
+void close_modem();
+int  uart_set_rate(int, int, int);
+int  uart_probe(int, const char *, int);
+int  negotiate_baud(int);
+
+int  make_bundle(const study_bundle *, mem_buf *);
+int  deliver_bundle(const study_bundle *);
+
+// queue_frame() context: where the frames go, and the job they are copied from
+struct frame_queue {
+	bounded_queue<upload_job> *uploads;
+	upload_job                 tmpl;
+};
+
+// dedup index: SOP Instance UID + content hash -> converted / uploaded. Open addressing
+// table in a memory mapped file, so lookups stay a few memory reads at any size.
+enum { DEDUP_NONE = 0, DEDUP_CONVERTED = 1, DEDUP_UPLOADED = 2 };
+
+struct dedup_slot {
+	uint64_t uid_hash;		// 0 marks a free slot
+	uint64_t content_hash;
+	uint32_t state;
+	uint32_t jpeg_size;
+	int64_t  stamp;
+};
+
+struct dedup_header {
+	char     magic[8];
+	uint64_t capacity;		// slots, power of 2
+	uint64_t count;
+	uint64_t reserved;
+};
+
+struct dedup_index {
+	int           fd;
+	size_t        map_size;
+	dedup_header *hdr;
+	dedup_slot   *slots;
+	string        path;
+	string        cache_dir;	// cached JPEGs, <content hash>-<settings hash>.jpeg
+	mutex         mtx;
+};
+
+uint64_t xxh64(const void *, size_t, uint64_t);
+int  hash_file(const char *, uint64_t *);
+int  dedup_open(dedup_index *, const char *);
+void dedup_close(dedup_index *);
+int  dedup_lookup(dedup_index *, uint64_t, uint64_t);
+int  dedup_mark(dedup_index *, uint64_t, uint64_t, int, size_t);
+uint64_t encode_settings_hash(const encode_profile *);
+int  cache_load(dedup_index *, uint64_t, uint64_t, mem_buf *);
+int  cache_store(dedup_index *, uint64_t, uint64_t, const mem_buf *);
+void cache_drop(dedup_index *, uint64_t);
+
+// durable work queue of the watch mode: append only journal of entry states plus an
+// index snapshot, replayed at start so nothing is lost on power failure
+enum { JOB_PENDING = 0, JOB_CONVERTING = 1, JOB_UPLOADING = 2, JOB_DONE = 3, JOB_FAILED = 4 };
+enum { PRIO_ROUTINE = 0, PRIO_STAT = 1 };
+
+struct queue_entry {
+	uint64_t id;
+	string   path;
+	int      priority;
+	int      state;
+	int      attempts;		// failed uploads so far
+	time_t   not_before;	// retry backoff, not journaled
+};
+
+// journal / index record, followed by path_len bytes of path
+struct journal_rec {
+	uint32_t magic;
+	uint32_t check;			// low 32 bits of xxh64 over the rest of the record
+	uint64_t id;
+	uint8_t  state;
+	uint8_t  priority;
+	uint16_t path_len;
+	uint8_t  attempts;
+	uint8_t  reserved[3];
+};
+
+struct work_queue {
+	int      fd;				// journal, append only
+	string   journal_path;
+	string   index_path;
+	map<uint64_t, queue_entry> entries;	// not done yet
+	set<string> paths;
+	uint64_t next_id;
+	long     records;			// in the journal since the last compaction
+	bool     closed;
+	mutex    mtx;
+	condition_variable cv;
+};
+
+int  wq_open(work_queue *, const char *);
+void wq_close(work_queue *);
+int  wq_add(work_queue *, const string &, int);
+bool wq_take(work_queue *, queue_entry *);
+void wq_set_state(work_queue *, uint64_t, int);
+int  wq_retry(work_queue *, uint64_t);
+void wq_shutdown(work_queue *);
+int  study_priority(const study_info *);
+
+// watch mode: spool directory -> converters -> uploader
+int  run_watch(const char *);
+void watch_spool(const char *, work_queue *);
+void convert_worker(work_queue *, bounded_queue<upload_job> *);
+int  queue_frame(unsigned long, const mem_buf *, void *);
+void retire_spool_file(const char *, const string &, int);
 
 // global constants
-const char at_D[] = {0x0D};
-const char at_A[] = {0x1A};
-const char *l1    = "+FTPPUT:1,1,1200";
-const char *l2    = "+FTPPUT:2,1000";
-const char *l3    = "+FTPPUT:2,";
-const char *l4    = "+FTPPUT:1,0";
+const char at_D[] = {0x0D, 0};
+const char at_A[] = {0x1A, 0};
+const char *reply_tokens[TOK_COUNT] = {"OK", "ERROR", "FAIL", "CONNECT\r", "CLOSED", "+FTPPUT:", "+FTPSIZE:", "+CMGS:", "+HTTPACTION:"};
+const char trace_magic[] = "ATTRACE1";
+const int  ftp_reply_timeout = 60;	// seconds without a reply before the session counts as lost
+const int  ftp_resume_max    = 3;	// resumes of one upload before giving up
+const int  ftp_chunk_cap     = 1460;	// caps what the modem may advertise
+const int  ftp_chunk_min     = 256;
+const double ftp_chunk_rtt   = 2.0;	// seconds per chunk above which the chunk shrinks
+const double ftp_full_max    = 30;	// seconds of +FTPPUT:2,0 (modem buffer full) before the session counts as stuck
+const int  bearer_check_idle = 30;	// seconds of link silence before the bearer is checked
+const int  at_cmd_timeout = 90;		// seconds, SAPBR=1,1 and CIICR may take 85
+const size_t at_line_max = 256;
+const int  modem_probe_idle = 60;	// seconds a modem sits idle before it is asked whether it still answers
+
+// AT scripts. Settings that don't depend on each other share one ';' separated line: one
+// round trip for all of them, and the modem stops at the first that fails.
+constexpr at_step ftp_setup_script[] = {
+	{ AT_FRAME("AT+FTPCID=1;+FTPSERV=\"www.kaimsofttech.com\";+FTPUN=\"kaimsoft\";+FTPPW=\"1234Four!\";"
+	           "+FTPPUTPATH=\"/www/prestashop/\";+FTPGETPATH=\"/www/prestashop/\"\r"), "OK", ftp_reply_timeout },
+};
+constexpr at_step bearer_setup_script[] = {
+	{ AT_FRAME("AT+SAPBR=3,1,\"Contype\",\"GPRS\";+SAPBR=3,1,\"APN\",\"internet\"\r"), "OK", ftp_reply_timeout },
+};
+constexpr at_step ip_setup_script[] = {
+	{ AT_FRAME("AT+CIPSHUT\r"),                     "SHUT OK", ftp_reply_timeout },
+	{ AT_FRAME("AT+CIPMODE=1;+CSTT=\"internet\"\r"), "OK",      ftp_reply_timeout },	// transparent, after CONNECT everything written goes to the socket
+	{ AT_FRAME("AT+CIICR\r"),                       "OK",      at_cmd_timeout },
+	{ AT_FRAME("AT+CIFSR\r"),                       ".",       ftp_reply_timeout, true },	// answers with the IP address alone
+};
+constexpr at_step bearer_open_script[] = {
+	{ AT_FRAME("AT+SAPBR=1,1\r"), "OK", at_cmd_timeout },
+};
+constexpr at_step bearer_check_script[] = {
+	{ AT_FRAME("AT+SAPBR=2,1\r"), "+SAPBR: 1,1", ftp_reply_timeout },	// status 1, connected
+};
+const int  bearer_open_tries = 5;	// SAPBR=1,1 fails now and then while the network attaches
+constexpr at_step ftp_putopt_step[] = {
+	{ AT_FRAME("AT+FTPPUTOPT=\"STOR\"\r"), "OK", ftp_reply_timeout },
+	{ AT_FRAME("AT+FTPPUTOPT=\"APPE\"\r"), "OK", ftp_reply_timeout },	// resume
+};
+constexpr at_step ftp_put_step = { AT_FRAME("AT+FTPPUT=1\r"), "OK", ftp_reply_timeout };
+constexpr at_step ftp_size_step = { AT_FRAME("AT+FTPSIZE\r"), "OK", ftp_reply_timeout };
+constexpr at_step http_init_step = { AT_FRAME("AT+HTTPINIT\r"), "OK", ftp_reply_timeout };
+constexpr at_step http_action_step = { AT_FRAME("AT+HTTPACTION=1\r"), "OK", ftp_reply_timeout };
+constexpr at_step sms_setup_script[] = {
+	{ AT_FRAME("AT+CMGF=1\r"), "OK", ftp_reply_timeout },
+};
+
+const char *tcp_host = "www.kaimsofttech.com";	// receiver of the raw TCP transport
+const int  tcp_port  = 5000;
+const char *http_url = "http://www.kaimsofttech.com/upload.php";
+const size_t http_data_max = 318976;	// AT+HTTPDATA limit of the SIM800
+const int  http_action_timeout = 600;	// HTTPACTION is silent until the whole POST is through
+
+const long parallel_min_pixels = 1024 * 1024;	// below this one thread is faster
+const DcmTagKey tag_frames_of_interest(0x0028, 0x6020);	// Frame Numbers of Interest (FOI)
+const int roi_flat_tol = 12;	// max - min of a border row/column still counted as flat
+const int preview_max_side = 256;
+const int preview_quality  = 60;	// a few KB at 256x256
+const int convert_workers  = 2;		// watch mode, the encoder itself uses all cores too
+const size_t upload_queue_len = 4;	// converted images waiting for the modem, bounds memory
+const int  link_retry_min = 30;		// seconds before retrying after a failed upload, doubling ..
+const int  link_retry_max = 600;	// .. up to this
+const int  upload_attempts_max = 16;	// failed uploads before a file is given up, about 2 hours
+const long journal_compact_min = 256;	// records before the journal is folded into the index
+const size_t bundle_max_bytes = 2 * 1024 * 1024;	// a bigger study goes up in several bundles
+const int  bundle_wait = 5;			// seconds a bundle waits for more of its study
+const int  modem_fail_max = 3;		// failed uploads in a row that take a modem out of rotation ..
+const int  modem_revive   = 600;	// .. for this many seconds
+const int  uart_rates[] = {460800, 230400, 115200, 57600, 38400, 19200, 9600};	// fastest first
+const int  uart_default_rate = 115200;
+const char *sms_number = "9886889561";
+const int  sms_max_delay = 900;		// seconds a due notification waits for an idle link
+const int  sms_max_parts = 4;		// longer batches are cut, with a count of the rest
+const uint64_t dedup_min_capacity = 1 << 16;	// slots, 2 MB of index
+
+// "full" is the dcmj2pnm output, the others trade fidelity for airtime
+const encode_profile profiles[] = {
+	// name       bytes   secs  rate  minq maxq down crop
+	{ "full",     0,      0,    0,    90,  90,  0,   0 },
+	{ "gprs",     0,      120,  2000, 40,  90,  2,   1 },
+	{ "fast",     0,      30,   2000, 30,  80,  3,   1 },
+	{ "150k",     150000, 0,    0,    40,  90,  2,   1 },
+};
+
+const transport transports[] = {
+	{ "ftp",  upload_file },
+	{ "tcp",  tcp_upload },
+	{ "http", http_upload },
+};
 
 // global variables
-char	   uart_str[1000];
-int  	   uart0_filestream = -1;
-int		   tx_enable = 1; 
-OFString   patientName;
+// one modem per thread: the serial port and session state are per thread, so the AT code
+// runs unchanged on every modem of the watch mode
+thread_local char   uart_str[1000];
+thread_local int    uart0_filestream = -1;
+thread_local int    tx_enable = 1; 
+thread_local int    ftp_max_len = 1000;		// +FTPPUT:1,1,<max> of the current session
+thread_local int    ftp_chunk   = 1000;		// adapted per chunk, kept across uploads
+thread_local int    bearer_up   = 0;		// bearer opened, kept between uploads
+thread_local int    ip_up       = 0;		// CIICR done, the TCP transport's connection
+thread_local int    ftp_configured = 0;		// FTPCID .. FTPPUTPATH set in the modem
+thread_local int    ftp_putopt  = -1;		// FTPPUTOPT in the modem, 1 APPE, 0 STOR
+thread_local time_t link_used   = 0;		// last time the link was seen working
+thread_local at_engine *at_eng = NULL;
+thread_local FILE   *uart_trace = NULL;		// -T, from the port's open to its close
+const transport *xport = &transports[0];
+const char *modem_devs = "/dev/ttyAMA0";	// comma separated, watch mode uploads on all of them
+const char *trace_prefix = NULL;			// serial traces go to <prefix>.<device name>
+int        uart_rtscts = 0;				// RTS/CTS wired to the modem(s)
+int        sms_window  = -1;				// seconds studies are collected per SMS, -1 for none
+sms_batch  notices;
+frame_select frame_sel = {0, -1, 1, 0};	// all frames of a multi-frame object
+const encode_profile *enc_profile = &profiles[0];
+atomic<double> link_rate(0);			// measured upload rate, bytes/s
+int        preview_first = 1;			// upload <name>_preview.jpeg ahead of <name>.jpeg
+int        progressive_full = 0;		// <name>.jpeg as progressive JPEG, encoded on one thread
+volatile sig_atomic_t stop_watch = 0;	// SIGINT / SIGTERM in watch mode
+const char *stat_modalities = "";		// comma separated, these jump the queue like STAT requests
+int        bundle_enabled = 0;
+int        dedup_enabled = 1;			// watch mode skips studies it has seen before
+dedup_index dedup;
 
 //tmp
 int read_ok;
 
-int main()
+static void on_stop_signal(int)
 {
+	stop_watch = 1;
+}
+
+// dcm_2_jpg_ftp                 converts and uploads one.dcm as one9.jpeg
+// dcm_2_jpg_ftp -w <spool dir>  keeps converting and uploading what the modalities drop there
+//   -p <profile>   encode profile (full, gprs, fast, 150k)
+//   -n <N>         every Nth frame of multi-frame objects
+//   -k             key frames only
+//   -s             single upload, no preview
+//   -P             full image as progressive JPEG, drawn coarse first but encoded on one core
+//   -d             watch mode without the dedup index
+//   -S <CT,MR>     modalities uploaded ahead of routine studies, as STAT requests are
+//   -b             watch mode, a study's images in one tar upload, for a server that unpacks it
+//   -i             watch mode, one upload per image (the default)
+//   -t <transport> ftp (default), tcp (AT+CIPSEND, transparent) or http (AT+HTTPACTION POST)
+//   -m <devs>      modems, /dev/ttyUSB0,/dev/ttyUSB1 .. (default /dev/ttyAMA0), the first one
+//                  without -w, so a pty of MODEM_EMULATOR can stand in for the modem
+//   -H             RTS/CTS are wired, use hardware flow control
+//   -N <secs>      watch mode, one SMS for the studies completed within secs
+//   -T <prefix>    serial trace of every modem to <prefix>.<device name>, for MODEM_EMULATOR -R
+int main(int argc, char *argv[])
+{
+	const char *watch_dir = NULL;
+	int opt;
+	
+	while((opt = getopt(argc, argv, "w:p:n:ksPdS:bit:m:HN:T:")) != -1) {
+		switch(opt) {
+		case 'w': watch_dir = optarg; break;
+		case 'p':
+			if(NULL == (enc_profile = find_profile(optarg))) { cerr << "Unknown profile " << optarg << endl; return 1; }
+			break;
+		case 'n': frame_sel.step = atol(optarg); break;
+		case 'k': frame_sel.key_only = 1; break;
+		case 's': preview_first = 0; break;
+		case 'P': progressive_full = 1; break;
+		case 'd': dedup_enabled = 0; break;
+		case 'S': stat_modalities = optarg; break;
+		case 'b': bundle_enabled = 1; break;
+		case 'i': bundle_enabled = 0; break;
+		case 'm': modem_devs = optarg; break;
+		case 'H': uart_rtscts = 1; break;
+		case 'N': sms_window = atoi(optarg); break;
+		case 'T': trace_prefix = optarg; break;
+		case 't':
+			if(NULL == (xport = find_transport(optarg))) { cerr << "Unknown transport " << optarg << endl; return 1; }
+			break;
+		default:
+			cerr << "usage: " << argv[0] << " [-w spool_dir] [-p profile] [-n every_nth_frame] [-k] [-s] [-P] [-d] [-S modalities] [-b] [-i] [-t transport] [-m modems] [-H] [-N sms_window] [-T trace_prefix]" << endl;
+			return 1;
+		}
+	}
+	
 	if (!bcm2835_init())
 		return 1;
 	
+	// the watch mode opens its modems itself
+	if(!watch_dir) uart0_filestream = open_modem(string(modem_devs, strcspn(modem_devs, ",")).c_str());
+    
+    // decoders for compressed DICOM input (JPEG, RLE)
+    DJDecoderRegistration::registerCodecs();
+    DcmRLEDecoderRegistration::registerCodecs();
+    
+    mem_buf jpg = {NULL, 0};
+    if(watch_dir) {
+    	run_watch(watch_dir);
+    }
+    else {
+	   	// store the image info, cheap - the pixel data isn't read
+	   	study_info study = {};
+	   	int have_study = (0 == read_study_info("one.dcm", &study));
+	   	if(!have_study) cerr << "Study details not available" << endl;
+	   	
+	   	// convert the image, a file that didn't parse goes the single image way
+	   	if(have_study && study.frames > 1) {
+	   		// cine / enhanced objects: each frame is converted and uploaded before the next is read
+	   		frame_upload dest = {"one9", 1};
+	   		if(convert_dcm_frames("one.dcm", &frame_sel, upload_frame, &dest) <= 0)
+	   			cerr << "Nothing to upload" << endl;
+	   	}
+	   	else if(-1 == convert_dcm_2_jpg("one.dcm", &jpg)) cerr << "Nothing to upload" << endl;
+			
+		// send sms
+		//send_sms(study.patientName.c_str());
+		
+		// upload file throught FTP
+		if(jpg.data) deliver_jpeg("one9", &jpg, preview_first);
+	}
+	   
+    // clean up
+    free(jpg.data);
+    DcmRLEDecoderRegistration::cleanup();
+    DJDecoderRegistration::cleanup();
+    close_modem();
+    bcm2835_close();
+  
+	return 0;
+	
+}
+
+// Serial port of a modem, 8N1, blocking reads, at the fastest rate the modem and the
+// port agree on. -1 if it can't be opened.
+int open_modem(const char *dev)
+{
 	// Open the Port. We want read/write, no "controlling tty" status, and open it no matter what state DCD is in
-    uart0_filestream = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY | O_NDELAY);
-    if (uart0_filestream == -1) 	perror("open_port: Unable to open /dev/ttyAMA0 - ");
+    int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+    if (fd == -1) {
+    	cerr << "open_port: Unable to open " << dev << " - " << strerror(errno) << endl;
+    	return -1;
+    }
+    uart_trace = trace_open(dev);
 	
-		// Set Port Parameters
-	struct termios options;
-    tcgetattr(uart0_filestream, &options);
-    options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;		//<Set baud rate
-    options.c_iflag = IGNPAR;
-    options.c_oflag = 0;
-    options.c_lflag = 0;
-    options.c_cc[VMIN] = 1;
-    tcflush(uart0_filestream, TCIFLUSH);
-	if(-1 == tcsetattr(uart0_filestream, TCSANOW, &options))	perror("tccsetattr error  !!!! ");
+	if(-1 == uart_set_rate(fd, uart_default_rate, 0))	perror("tccsetattr error  !!!! ");
 	
 	// Turn off blocking for reads, use (fd, F_SETFL, FNDELAY) if you want that
-    fcntl(uart0_filestream, F_SETFL, 0);
+    fcntl(fd, F_SETFL, 0);
     
     // dummy read
     //char tmp;
-    //read(uart0_filestream, &tmp, 1);
+    //read(fd, &tmp, 1);
     
+    int rate = negotiate_baud(fd);
+    if(rate == -1) cerr << dev << ": modem not answering, left at " << uart_default_rate << " baud" << endl;
+    else cout << dev << " at " << rate << " baud" << endl;
     
-   	// convert & store the image info
-   	//convert_dcm_2_jpg();
-		
-	// send sms
-	//send_sms();
+    // from here on the engine reads the port
+    if(NULL == (at_eng = at_start(fd, uart_trace))) {
+    	close(fd);
+    	if(uart_trace) fclose(uart_trace);
+    	uart_trace = NULL;
+    	return -1;
+    }
+    return fd;
+}
+
+// Stops the modem's AT engine and closes its port
+void close_modem()
+{
+	if(at_eng) at_stop(at_eng);
+	at_eng = NULL;
+	if(uart0_filestream != -1) close(uart0_filestream);
+	uart0_filestream = -1;
+	if(uart_trace) fclose(uart_trace);
+	uart_trace = NULL;
+}
+
+// Port parameters, rtscts for hardware flow control. Waits for what is queued to go out
+// at the old rate first.
+int uart_set_rate(int fd, int rate, int rtscts)
+{
+	speed_t baud;
+	switch(rate) {
+	case 460800: baud = B460800; break;
+	case 230400: baud = B230400; break;
+	case 115200: baud = B115200; break;
+	case 57600:  baud = B57600;  break;
+	case 38400:  baud = B38400;  break;
+	case 19200:  baud = B19200;  break;
+	case 9600:   baud = B9600;   break;
+	default:     return -1;
+	}
 	
-	// upload file throught FTP
-	upload_file();
-	   
-    // clean up
-    close(uart0_filestream);
-    bcm2835_close();
-  
-	return 0;
+		// Set Port Parameters
+	struct termios options;
+    tcgetattr(fd, &options);
+    options.c_cflag = baud | CS8 | CLOCAL | CREAD | (rtscts ? CRTSCTS : 0);		//<Set baud rate
+    options.c_iflag = IGNPAR;
+    options.c_oflag = 0;
+    options.c_lflag = 0;
+    options.c_cc[VMIN] = 1;
+    tcdrain(fd);
+    tcflush(fd, TCIFLUSH);
+	return tcsetattr(fd, TCSANOW, &options);
+}
+
+// Sends cmd and waits up to ms for the reply. 0 on OK, -1 on ERROR or silence. Works on the
+// bare fd, before the AT routines take the port.
+int uart_probe(int fd, const char *cmd, int ms)
+{
+	char buf[128];
+	size_t len = 0;
+	string line = string(cmd) + "\r";
+	struct pollfd pfd = {fd, POLLIN, 0};
+	
+	tcflush(fd, TCIFLUSH);
+	if(write(fd, line.data(), line.size()) != (ssize_t)line.size()) return -1;
+	trace_bytes(uart_trace, TRACE_TX, line.data(), line.size());
+	while(poll(&pfd, 1, ms) > 0) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if(n <= 0) return -1;
+		trace_bytes(uart_trace, TRACE_RX, buf + len, n);
+		len += n;
+		buf[len] = 0;
+		if(strstr(buf, "OK")) return 0;
+		if(strstr(buf, "ERROR")) return -1;
+		if(len > 64) {			// keep the tail, a reply may straddle the cut
+			memmove(buf, buf + len - 8, 8);
+			len = 8;
+		}
+	}
+	return -1;
+}
+
+// Finds the rate the modem is at (it may still be at a rate set by an earlier run), turns
+// on RTS/CTS on both ends when uart_rtscts, then steps the modem up with AT+IPR to the
+// fastest of uart_rates both ends manage. A rate the modem takes but doesn't answer at is
+// undone and the link stays at the previous one. The rate in use, -1 if the modem is silent.
+int negotiate_baud(int fd)
+{
+	const int nrates = sizeof(uart_rates) / sizeof(uart_rates[0]);
+	int cur = -1, flow = 0;
+	char cmd[32];
+	
+	if(0 == uart_probe(fd, "AT", 500)) cur = uart_default_rate;
+	for(int i = 0; i < nrates && cur == -1; i++)
+		if(0 == uart_set_rate(fd, uart_rates[i], 0) && 0 == uart_probe(fd, "AT", 500)) cur = uart_rates[i];
+	if(cur == -1) {
+		uart_set_rate(fd, uart_default_rate, 0);
+		return -1;
+	}
 	
+	// without flow control a faster port only overruns the modem's buffer sooner
+	if(uart_rtscts && 0 == uart_probe(fd, "AT+IFC=2,2", 500)) {
+		uart_set_rate(fd, cur, 1);
+		if(0 == uart_probe(fd, "AT", 500)) flow = 1;
+		else {
+			uart_set_rate(fd, cur, 0);
+			uart_probe(fd, "AT+IFC=0,0", 500);
+			cerr << "RTS/CTS not working, flow control off" << endl;
+		}
+	}
+	if(!flow) return cur;
+	
+	for(int i = 0; i < nrates && uart_rates[i] > cur; i++) {
+		snprintf(cmd, sizeof(cmd), "AT+IPR=%d", uart_rates[i]);
+		if(-1 == uart_probe(fd, cmd, 500)) continue;		// not a rate of this modem
+		
+		uart_set_rate(fd, uart_rates[i], flow);
+		usleep(100000);
+		if(0 == uart_probe(fd, "AT", 500) || 0 == uart_probe(fd, "AT", 500)) return uart_rates[i];
+		
+		// back to the previous rate: ask for it at the new one, listen at the old one
+		snprintf(cmd, sizeof(cmd), "AT+IPR=%d\r", cur);
+		if(write(fd, cmd, strlen(cmd)) < 0) perror("AT Write Error  !!!! ");
+		else trace_bytes(uart_trace, TRACE_TX, cmd, strlen(cmd));
+		uart_set_rate(fd, cur, flow);
+		usleep(100000);
+		if(-1 == uart_probe(fd, "AT", 500)) cerr << "Modem lost at " << uart_rates[i] << " baud" << endl;
+	}
+	return cur;
 }
 
-int convert_dcm_2_jpg()
+// Header only read of dcm_file: parsing stops at the PixelData tag, so a
+// multi hundred MB CT/MR costs no more than its attributes.
+int read_study_info(const char *dcm_file, study_info *info)
 {
 	DcmFileFormat fileformat;
-    OFCondition status = fileformat.loadFile("one.dcm");
-    if (status.good())
+    OFCondition status = fileformat.loadFileUntilTag(dcm_file, EXS_Unknown, EGL_noChange,
+                                                     DCM_MaxReadLength, ERM_autoDetect, DCM_PixelData);
+    if (status.bad())
     {
-      if (fileformat.getDataset()->findAndGetOFString(DCM_PatientName, patientName).good())
-        cout << "Patient's Details Successfully Read " << endl;
-      else
-        cerr << "Error: cannot access Patient's Name!" << endl;
+      cerr << "Error: cannot read DICOM header (" << status.text() << ")" << endl;
+      return -1;
     }
+
+    get_study_info(fileformat.getDataset(), info);
+    if (info->patientName.empty())
+      cerr << "Error: cannot access Patient's Name!" << endl;
     else
+      cout << "Patient's Details Successfully Read " << endl;
+
+    return 0;
+}
+
+// Missing attributes are left empty / zero
+void get_study_info(DcmDataset *dset, study_info *info)
+{
+	dset->findAndGetOFString(DCM_PatientName, info->patientName);
+	dset->findAndGetOFString(DCM_PatientID, info->patientID);
+	dset->findAndGetOFString(DCM_Modality, info->modality);
+	dset->findAndGetOFString(DCM_StudyDate, info->studyDate);
+	dset->findAndGetOFString(DCM_StudyDescription, info->studyDescription);
+	dset->findAndGetOFString(DCM_AccessionNumber, info->accessionNumber);
+	dset->findAndGetOFString(DCM_StudyInstanceUID, info->studyUID);
+	dset->findAndGetOFString(DCM_SeriesInstanceUID, info->seriesUID);
+	dset->findAndGetOFString(DCM_SOPInstanceUID, info->sopInstanceUID);
+	dset->findAndGetOFString(DCM_RequestedProcedurePriority, info->priority, 0, OFTrue);
+	
+	info->rows = info->columns = 0;
+	info->frames = 1;
+	dset->findAndGetUint16(DCM_Rows, info->rows);
+	dset->findAndGetUint16(DCM_Columns, info->columns);
+	dset->findAndGetLongInt(DCM_NumberOfFrames, info->frames);
+	if(info->frames < 1) info->frames = 1;
+}
+
+// Loads dcm_file once, and renders it to JPEG from the same dataset.
+// The JPEG is written into jpg->data (malloc'ed, caller frees), nothing touches the SD card.
+int convert_dcm_2_jpg(const char *dcm_file, mem_buf *jpg)
+{
+	DcmFileFormat fileformat;
+    OFCondition status = fileformat.loadFile(dcm_file);
+    if (status.bad())
+    {
       cerr << "Error: cannot read DICOM file (" << status.text() << ")" << endl;
+      return -1;
+    }
 
-    if(-1 == system("dcmj2pnm one.dcm one.jpeg --write-jpeg"))
-      cerr << "Error in conversion of DCM to JPEG" << endl;
-    else
-      cout << "DCM File Converted to JPEG successfully" << endl;
+    return convert_frame(&fileformat, 0, jpg);
+}
+
+// Loads dcm_file with the pixel data left in the file (elements above DCM_MaxReadLength
+// are read on access), then converts the selected frames one by one and hands each JPEG
+// to sink. Peak memory is one frame, whatever the number of frames.
+// Returns the number of frames converted, -1 on error or when sink fails.
+int convert_dcm_frames(const char *dcm_file, const frame_select *sel, frame_sink sink, void *ctx)
+{
+	DcmFileFormat fileformat;
+    OFCondition status = fileformat.loadFile(dcm_file, EXS_Unknown, EGL_noChange, DCM_MaxReadLength);
+    if (status.bad())
+    {
+      cerr << "Error: cannot read DICOM file (" << status.text() << ")" << endl;
+      return -1;
+    }
+    
+    DcmDataset *dset = fileformat.getDataset();
+    long frames = 1, first = sel->first, last = sel->last, step = sel->step;
+    dset->findAndGetLongInt(DCM_NumberOfFrames, frames);
+    if (frames < 1) frames = 1;
+    if (first < 0) first = 0;
+    if (last < 0 || last >= frames) last = frames - 1;
+    if (step < 1 || sel->key_only) step = 1;
+    
+    // key frames: representative frame and frames of interest, 1 based in the file
+    vector<char> key(frames, 0);
+    if (sel->key_only)
+    {
+      Uint16 num = 0;
+      int found = 0;
+      if (dset->findAndGetUint16(DCM_RepresentativeFrameNumber, num).good() && num >= 1 && num <= frames)
+        key[num - 1] = found = 1;
+      for (unsigned long i = 0; dset->findAndGetUint16(tag_frames_of_interest, num, i).good(); i++)
+        if (num >= 1 && num <= frames) key[num - 1] = found = 1;
+      if (!found) key[0] = 1;
+    }
+    
+    int done = 0;
+    for (long f = first; f <= last; f += step)
+    {
+      if (sel->key_only && !key[f]) continue;
       
-    return 0;
-		
+      mem_buf jpg = {NULL, 0};
+      if (-1 == convert_frame(&fileformat, f, &jpg))
+      {
+        cerr << "Error: frame " << f + 1 << " of " << frames << " not converted" << endl;
+        continue;
+      }
+      cout << "Frame " << f + 1 << " of " << frames << endl;
+      
+      int ret = sink(f, &jpg, ctx);
+      free(jpg.data);
+      if (ret == -1) return -1;
+      done++;
+    }
+    
+    return done;
 }
 
-void send_sms()
+// frame_sink for the uploader, ctx is a frame_upload
+int upload_frame(unsigned long frame, const mem_buf *jpg, void *ctx)
 {
-	if(tx_enable) {
-		
-		strcpy(uart_str,"AT");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
-		
+	frame_upload *dest = (frame_upload *)ctx;
+	char name[128];
+	
+	snprintf(name, sizeof(name), "%s_%04lu", dest->base, frame + 1);
+	deliver_jpeg(name, jpg, preview_first && dest->previews > 0);
+	if(dest->previews > 0) dest->previews--;
+	
+	return 0;
+}
+
+// Uploads base.jpeg. With preview, base_preview.jpeg goes first, so the viewer has
+// something to show within seconds while the full image is still on the link.
+int deliver_jpeg(const char *base, const mem_buf *jpg, int preview)
+{
+	char name[128];
+	mem_buf prev = {NULL, 0};
+	
+	if(preview) {
+		if(0 == make_preview(jpg, &prev)) {
+			snprintf(name, sizeof(name), "%s_preview.jpeg", base);
+			cout << "Preview " << prev.size << " bytes" << endl;
+			xport->put(name, &prev);
+			free(prev.data);
+		}
+		else cerr << "Error: preview not generated" << endl;
 	}
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	snprintf(name, sizeof(name), "%s.jpeg", base);
+	return xport->put(name, jpg);
+}
+
+// ustar header of a member of size bytes, type '0' for a file. name has to fit in 99 bytes.
+static void tar_header(unsigned char *h, const string &name, size_t size, char type)
+{
+	unsigned sum = 0;
 	
-	if(tx_enable) {
-		
-		strcpy(uart_str,"AT+CMGF=1");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT + CMGF Write Error  !!!! ");
-		
+	memset(h, 0, 512);
+	snprintf((char *)h, 100, "%s", name.c_str());
+	memcpy(h + 100, "0000644", 8);
+	memcpy(h + 108, "0000000", 8);
+	memcpy(h + 116, "0000000", 8);
+	snprintf((char *)h + 124, 12, "%011lo", (unsigned long)size);
+	snprintf((char *)h + 136, 12, "%011lo", (unsigned long)time(NULL));
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	
+	memset(h + 148, ' ', 8);
+	for(int i = 0; i < 512; i++) sum += h[i];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+}
+
+static size_t tar_padded(size_t size)
+{
+	return (size + 511) & ~(size_t)511;
+}
+
+// Bytes of a member in the tar: a name of 100 bytes or more goes in a GNU long name
+// record ahead of it (GNU tar, bsdtar and Python's tarfile read those)
+static size_t tar_member_size(const string &name, size_t size)
+{
+	size_t n = 512 + tar_padded(size);
+	if(name.size() >= 100) n += 512 + tar_padded(name.size() + 1);
+	return n;
+}
+
+// Writes a member at p, returns where the next one goes
+static unsigned char *tar_member(unsigned char *p, const string &name, const void *data, size_t size)
+{
+	if(name.size() >= 100) {
+		tar_header(p, "././@LongLink", name.size() + 1, 'L');
+		memcpy(p + 512, name.c_str(), name.size() + 1);
+		p += 512 + tar_padded(name.size() + 1);
 	}
+	tar_header(p, name.substr(0, 99), size, '0');
+	memcpy(p + 512, data, size);
+	return p + 512 + tar_padded(size);
+}
+
+// tar of the bundle: index.html, a page showing every image, then the images as
+// <name>.jpeg. Stored, JPEG doesn't compress any further.
+int make_bundle(const study_bundle *bundle, mem_buf *tar)
+{
+	string index = "<html><body>\n";
+	size_t total = 1024;		// end of archive
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-		
-	if(tx_enable) {
+	for(size_t i = 0; i < bundle->parts.size(); i++) {
+		const upload_job &part = bundle->parts[i];
+		index += "<p>" + part.name + "</p><img src=\"" + part.name + ".jpeg\"><br>\n";
+		total += tar_member_size(part.name + ".jpeg", part.jpg.size);
+	}
+	index += "</body></html>\n";
+	total += tar_member_size("index.html", index.size());
+	
+	tar->data = (unsigned char *)calloc(1, total);
+	if(tar->data == NULL) return -1;
+	tar->size = total;
+	
+	unsigned char *p = tar_member(tar->data, "index.html", index.data(), index.size());
+	for(size_t i = 0; i < bundle->parts.size(); i++) {
+		const upload_job &part = bundle->parts[i];
+		p = tar_member(p, part.name + ".jpeg", part.jpg.data, part.jpg.size);
+	}
+	return 0;
+}
+
+// A single image goes up as it is, more as <first name>_<count>.tar after the preview
+// of the first one
+int deliver_bundle(const study_bundle *bundle)
+{
+	const upload_job &first = bundle->parts[0];
+	char name[160];
+	mem_buf tar;
+	int ret;
+	
+	if(bundle->parts.size() == 1) return deliver_jpeg(first.name.c_str(), &first.jpg, first.preview);
+	
+	if(first.preview) {
+		mem_buf prev = {NULL, 0};
+		if(0 == make_preview(&first.jpg, &prev)) {
+			snprintf(name, sizeof(name), "%s_preview.jpeg", first.name.c_str());
+			xport->put(name, &prev);
+			free(prev.data);
+		}
+	}
+	
+	if(-1 == make_bundle(bundle, &tar)) {
+		cerr << "Error: bundle not built" << endl;
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%s_%zu.tar", first.name.c_str(), bundle->parts.size());
+	cout << "Bundle " << name << ", " << bundle->parts.size() << " images, " << tar.size << " bytes" << endl;
+	ret = xport->put(name, &tar);
+	free(tar.data);
+	return ret;
+}
+
+// Watch mode. Files dropped into dir are journaled in the work queue and converted on
+// convert_workers threads, STAT first, while one thread per modem uploads: conversion of
+// file N+1 overlaps the upload of file N. Images of one study go up together as one tar,
+// one FTP put instead of one per slice, and a large study in several bundles that the
+// modems share. Uploaded files go to dir/done, the ones that can't be converted to
+// dir/failed. When an upload fails the file goes back in the queue and that modem backs
+// off, so the spool drains by itself once a bearer is back. Runs until SIGINT / SIGTERM;
+// what is not uploaded by then stays in the journal for the next start.
+int run_watch(const char *dir)
+{
+	work_queue                wq;
+	bounded_queue<upload_job> uploads(upload_queue_len, upload_before);
+	string sub;
+	
+	sub = string(dir) + "/done";   mkdir(sub.c_str(), 0755);
+	sub = string(dir) + "/failed"; mkdir(sub.c_str(), 0755);
+	
+	if(-1 == wq_open(&wq, dir)) {
+		perror("work queue journal error  !!!! ");
+		return -1;
+	}
+	
+	if(dedup_enabled) {
+		sub = string(dir) + "/cache";  mkdir(sub.c_str(), 0755);
+		dedup.cache_dir = sub;
+		sub = string(dir) + "/dedup.idx";
+		if(-1 == dedup_open(&dedup, sub.c_str())) {
+			cerr << "Dedup index not available, every file is converted and uploaded" << endl;
+			dedup_enabled = 0;
+		}
+	}
+	
+	signal(SIGINT, on_stop_signal);
+	signal(SIGTERM, on_stop_signal);
+	
+	thread watcher(watch_spool, dir, &wq);
+	vector<thread> workers;
+	for(int i = 0; i < convert_workers; i++)
+		workers.push_back(thread(convert_worker, &wq, &uploads));
+	
+	// uploads are closed once the watcher has stopped and the converters are out
+	thread closer([&]() {
+		watcher.join();
+		wq_shutdown(&wq);
+		for(size_t i = 0; i < workers.size(); i++) workers[i].join();
+		uploads.close();
+	});
+	
+	// modems, the bundles are split so that a study spreads over all of them
+	vector<modem> modems;
+	for(const char *p = modem_devs; *p; ) {
+		size_t len = strcspn(p, ",");
+		modem m = {string(p, len), 0, 0, 0, 0};
+		if(len) modems.push_back(m);
+		p += len;
+		if(*p == ',') p++;
+	}
+	if(modems.empty()) {
+		cerr << "No modem to upload with" << endl;
+		stop_watch = 1;
+	}
+	size_t bundle_cap = bundle_max_bytes / max(modems.size(), (size_t)1);
+	
+	// what each file still waits for: bundles in flight, and its own last job
+	struct file_track {
+		int pending;
+		int lost;
+		int failed;
+		int has_end;
+		upload_job end;
+	};
+	map<uint64_t, file_track> files;
+	mutex track_mtx;
+	int count = 0;
+	
+	// called with track_mtx held: retire the file once all of it is through, or
+	// requeue it when one of its uploads failed, until it has failed upload_attempts_max times
+	auto check_done = [&](uint64_t qid) {
+		file_track &f = files[qid];
+		if(!f.has_end || f.pending) return;
+		const upload_job &end = f.end;
+		int delay;
+		if(f.lost && -1 != (delay = wq_retry(&wq, qid))) {
+			// keep the file queued, it goes to whichever modem is up
+			cout << "Upload of " << end.src << " failed, retrying in " << delay << " s" << endl;
+		}
+		else {
+			if(f.lost) {
+				cout << "Upload of " << end.src << " failed " << upload_attempts_max << " times, giving up" << endl;
+				f.failed = 1;
+			}
+			// remember the upload, the cached JPEG isn't needed any more
+			if(end.has_keys && !end.skipped && !f.failed) {
+				dedup_mark(&dedup, end.uid_hash, end.content_hash, DEDUP_UPLOADED, 0);
+				cache_drop(&dedup, end.content_hash);
+			}
+			// journal first: a crash before the move re-finds the file, and dedup skips it
+			wq_set_state(&wq, qid, f.failed ? JOB_FAILED : JOB_DONE);
+			retire_spool_file(dir, end.src, f.failed);
+			if(!f.failed && !end.skipped) notify_study(end.study, end.notice);
+			count++;
+		}
+		files.erase(qid);
+	};
+	
+	// Each modem takes the next bundle as soon as it is free, so a fast modem does more of
+	// the work than a slow one. A modem failing modem_fail_max uploads in a row sits out
+	// modem_revive seconds, the others carry on; its files go back in the queue. A modem
+	// that is paused or whose port won't open takes no bundles, until the watch stops.
+	bounded_queue<study_bundle> bundles(max(modems.size(), (size_t)1));
+	auto modem_loop = [&](modem *m) {
+		study_bundle b;
+		string sms;
+		int got;
+		time_t probed = time(NULL);
+		time_t paused = 0;
+		uart0_filestream = open_modem(m->dev.c_str());
 		
-		strcpy(uart_str,"AT+CMGS=\"9886889561\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT + CMGS Write Error  !!!! ");
+		for(;;) {
+			struct timespec t0, t1;
+			int ret = -1;
+			
+			if(!stop_watch && (uart0_filestream == -1 || time(NULL) < paused)) {
+				sleep(1);
+				if(uart0_filestream == -1 && time(NULL) >= paused) {
+					// start from scratch, the modem may have been reset or replugged
+					uart0_filestream = open_modem(m->dev.c_str());
+					bearer_up = ip_up = ftp_configured = 0;
+					ftp_putopt = -1;
+					m->fails = 0;
+					probed = time(NULL);
+					if(uart0_filestream == -1) paused = time(NULL) + link_retry_min;
+				}
+				continue;
+			}
+			if(-1 == (got = bundles.pop_wait(b, 1000))) break;
+			
+			// notifications go out while the link has nothing else to do
+			if(got == 0) {
+				if(uart0_filestream != -1 && !m->fails && take_notices(&sms, 1)) notices_sent(send_sms(sms.c_str()));
+				else if(uart0_filestream != -1 && time(NULL) - max(probed, link_used) >= modem_probe_idle) {
+					// a modem that stopped answering is reopened now, not found out by the next upload
+					at_result r = at_command(at_eng, "AT+CSQ", 5000).get();
+					probed = time(NULL);
+					if(r.status != AT_OK) {
+						cout << "Modem " << m->dev << " not answering, reopening" << endl;
+						close_modem();
+						uart0_filestream = open_modem(m->dev.c_str());
+						bearer_up = ip_up = ftp_configured = 0;
+						ftp_putopt = -1;
+					}
+				}
+				continue;
+			}
+			
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if(uart0_filestream != -1 && !(stop_watch && m->fails)) {
+				at_hold(at_eng, 1);
+				ret = deliver_bundle(&b);
+				at_hold(at_eng, 0);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			
+			{
+				lock_guard<mutex> lock(track_mtx);
+				for(size_t i = 0; i < b.parts.size(); i++) {
+					file_track &f = files[b.parts[i].qid];
+					f.pending--;
+					if(ret == -1) f.lost = 1;
+					check_done(b.parts[i].qid);
+					free(b.parts[i].jpg.data);
+				}
+			}
+			
+			if(ret == 0) {
+				m->fails = 0;
+				m->uploads++;
+				m->bytes   += b.bytes;
+				m->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+				if(take_notices(&sms, 0)) notices_sent(send_sms(sms.c_str()));	// overdue, link never idle
+				continue;
+			}
+			
+			int pause = min(link_retry_min << min(m->fails, 5), link_retry_max);
+			if(++m->fails >= modem_fail_max) {
+				cout << "Modem " << m->dev << " out of rotation for " << modem_revive << " s" << endl;
+				pause = modem_revive;
+				close_modem();		// reopened once the pause is over
+			}
+			paused = time(NULL) + pause;
+			bearer_up = ip_up = ftp_configured = 0;
+			ftp_putopt = -1;
+		}
+		if(uart0_filestream != -1 && !m->fails && take_notices(&sms, 2)) notices_sent(send_sms(sms.c_str()));
+		close_modem();
+	};
+	vector<thread> links;
+	for(size_t i = 0; i < modems.size(); i++) links.push_back(thread(modem_loop, &modems[i]));
+	
+	upload_job   job;
+	study_bundle bundle;
+	int got;
+	bundle.bytes = 0;
+	
+	auto flush = [&]() {
+		if(bundle.parts.empty()) return;
+		for(size_t i = 0; i < bundle.parts.size(); i++) wq_set_state(&wq, bundle.parts[i].qid, JOB_UPLOADING);
+		if(!bundles.push(bundle))
+			for(size_t i = 0; i < bundle.parts.size(); i++) free(bundle.parts[i].jpg.data);
+		bundle.parts.clear();
+		bundle.bytes = 0;
+	};
+	
+	// images of one study collect in the bundle until another study comes, it is full,
+	// or the queue stays empty for bundle_wait seconds
+	while(-1 != (got = uploads.pop_wait(job, bundle_wait * 1000))) {
+		if(got == 0) {
+			flush();
+			continue;
+		}
+		if(job.jpg.data && !bundle.parts.empty() && (job.study.empty() || bundle.parts[0].study != job.study ||
+		                                             bundle.bytes + job.jpg.size > bundle_cap)) flush();
+		{
+			// images count as pending from the time they join the bundle
+			lock_guard<mutex> lock(track_mtx);
+			file_track &f = files[job.qid];
+			if(job.failed) f.failed = 1;
+			if(job.jpg.data && f.lost) {
+				free(job.jpg.data);
+				job.jpg.data = NULL;
+			}
+			if(job.jpg.data) {
+				f.pending++;
+				bundle.parts.push_back(job);
+				bundle.bytes += job.jpg.size;
+			}
+			if(job.last) {
+				f.has_end = 1;
+				f.end = job;
+				check_done(job.qid);
+			}
+		}
+		if(!bundle_enabled || (job.jpg.data && job.study.empty())) flush();
+	}
+	flush();
+	bundles.close();
+	for(size_t i = 0; i < links.size(); i++) links[i].join();
+	
+	for(size_t i = 0; i < modems.size(); i++)
+		cout << "Modem " << modems[i].dev << ": " << modems[i].uploads << " uploads, " << modems[i].bytes << " bytes"
+		     << (modems[i].seconds > 0 ? ", " + to_string((long)(modems[i].bytes / modems[i].seconds)) + " bytes/s" : "") << endl;
+	
+	closer.join();
+	wq_close(&wq);
+	if(dedup_enabled) dedup_close(&dedup);
+	cout << "Watch stopped, " << count << " files handled" << endl;
+	return count;
+}
+
+bool upload_before(const upload_job &a, const upload_job &b)
+{
+	return a.priority > b.priority;
+}
+
+// Journals the files already in dir that the queue doesn't know, then every file closed
+// after writing or moved in. Hidden files (partial transfers) are ignored.
+void watch_spool(const char *dir, work_queue *wq)
+{
+	int fd = inotify_init1(IN_NONBLOCK);
+	if(fd == -1 || -1 == inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		perror("inotify error  !!!! ");
+		if(fd != -1) close(fd);
+		return;
+	}
+	
+	vector<string> names;
+	DIR *d = opendir(dir);
+	struct dirent *ent;
+	while(d && NULL != (ent = readdir(d)))
+		if(ent->d_type == DT_REG) names.push_back(ent->d_name);
+	if(d) closedir(d);
+	
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = {fd, POLLIN, 0};
+	
+	while(!stop_watch) {
+		for(size_t i = 0; i < names.size(); i++) {
+			if(names[i][0] == '.' || names[i].compare(0, 6, "queue.") == 0 || names[i].compare(0, 6, "dedup.") == 0) continue;
+			string path = string(dir) + "/" + names[i];
+			study_info study = {};
+			int prio = (0 == read_study_info(path.c_str(), &study)) ? study_priority(&study) : PRIO_ROUTINE;
+			if(0 == wq_add(wq, path, prio))
+				cout << "Spooled " << path << (prio == PRIO_STAT ? " (STAT)" : "") << endl;
+		}
+		names.clear();
+		
+		// wake up now and then to see stop_watch
+		if(poll(&pfd, 1, 500) <= 0) continue;
+		ssize_t len = read(fd, buf, sizeof(buf));
+		for(char *p = buf; len > 0 && p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if(ev->len && !(ev->mask & IN_ISDIR)) names.push_back(ev->name);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	
+	close(fd);
+}
+
+// STAT / HIGH requests, and the modalities listed with -S
+int study_priority(const study_info *study)
+{
+	if(study->priority == "STAT" || study->priority == "HIGH") return PRIO_STAT;
+	if(study->modality.empty()) return PRIO_ROUTINE;
+	
+	for(const char *p = stat_modalities; *p; ) {
+		size_t len = strcspn(p, ",");
+		if(len == study->modality.size() && 0 == strncmp(p, study->modality.data(), len)) return PRIO_STAT;
+		p += len;
+		if(*p == ',') p++;
+	}
+	return PRIO_ROUTINE;
+}
+
+// frame_sink of the watch mode, ctx is a frame_queue
+int queue_frame(unsigned long frame, const mem_buf *jpg, void *ctx)
+{
+	frame_queue *fq  = (frame_queue *)ctx;
+	upload_job   job = fq->tmpl;
+	char num[16];
+	
+	// the sink doesn't own jpg, the job needs its own copy
+	job.jpg.data = (unsigned char *)malloc(jpg->size);
+	if(job.jpg.data == NULL) return -1;
+	memcpy(job.jpg.data, jpg->data, jpg->size);
+	job.jpg.size = jpg->size;
+	
+	snprintf(num, sizeof(num), "_%04lu", frame + 1);
+	job.name += num;
+	fq->tmpl.preview = 0;		// preview of the first frame only
+	
+	if(!fq->uploads->push(job)) { free(job.jpg.data); return -1; }
+	return 0;
+}
+
+// Converter thread: queue entry -> one upload_job (or one per frame), the last one marked
+void convert_worker(work_queue *wq, bounded_queue<upload_job> *uploads)
+{
+	queue_entry entry;
+	
+	while(wq_take(wq, &entry)) {
+		const string &path = entry.path;
+		string base = path.substr(path.rfind('/') + 1);
+		study_info study = {};
+		upload_job job;
+		
+		if(base.rfind('.') != string::npos) base.erase(base.rfind('.'));
+		job.qid      = entry.id;
+		job.priority = entry.priority;
+		job.src     = path;
+		job.name    = base;
+		job.jpg.data = NULL;
+		job.jpg.size = 0;
+		job.preview = preview_first;
+		job.last    = 1;
+		job.failed  = 0;
+		job.skipped = 0;
+		job.has_keys = 0;
+		int state = DEDUP_NONE;
+		uint64_t settings = encode_settings_hash(enc_profile);
+		
+		if(-1 == read_study_info(path.c_str(), &study)) {
+			job.failed = 1;
+			uploads->push(job);
+			continue;
+		}
+		job.study = study.studyUID.c_str();
+		job.notice = string(study.patientName.c_str()) + " " + study.modality.c_str() + " " + study.studyDate.c_str();
+		
+		// resends of an instance have the same UID and the same bytes
+		if(dedup_enabled && !study.sopInstanceUID.empty() && 0 == hash_file(path.c_str(), &job.content_hash)) {
+			job.uid_hash = xxh64(study.sopInstanceUID.data(), study.sopInstanceUID.size(), 0);
+			job.has_keys = 1;
+			state = dedup_lookup(&dedup, job.uid_hash, job.content_hash);
+		}
+		
+		if(state == DEDUP_UPLOADED) {
+			cout << path << " already uploaded, skipped" << endl;
+			job.skipped = 1;
+		}
+		else if(study.frames > 1) {
+			// frames are queued as they are converted, the queue bound keeps memory in check
+			frame_queue fq;
+			fq.uploads   = uploads;
+			fq.tmpl      = job;
+			fq.tmpl.last = 0;
+			if(convert_dcm_frames(path.c_str(), &frame_sel, queue_frame, &fq) <= 0) job.failed = 1;
+		}
+		else if(state == DEDUP_CONVERTED && 0 == cache_load(&dedup, job.content_hash, settings, &job.jpg)) {
+			cout << path << " served from the cache (" << job.jpg.size << " bytes)" << endl;
+		}
+		else if(-1 == convert_dcm_2_jpg(path.c_str(), &job.jpg)) {
+			job.failed = 1;
+		}
+		else if(job.has_keys && 0 == cache_store(&dedup, job.content_hash, settings, &job.jpg)) {
+			dedup_mark(&dedup, job.uid_hash, job.content_hash, DEDUP_CONVERTED, job.jpg.size);
+		}
+		
+		if(!uploads->push(job)) free(job.jpg.data);
+	}
+}
+
+// XXH64, enough of it for file and UID hashes (little endian hosts)
+static const uint64_t xxh_p1 = 11400714785074694791ULL, xxh_p2 = 14029467366897019727ULL,
+                      xxh_p3 = 1609587929392839161ULL,  xxh_p4 = 9650029242287828579ULL,
+                      xxh_p5 = 2870177450012600261ULL;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) { return xxh_rotl(acc + in * xxh_p2, 31) * xxh_p1; }
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) { return (acc ^ xxh_round(0, v)) * xxh_p1 + xxh_p4; }
+static inline uint64_t xxh_read64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint32_t xxh_read32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = (const unsigned char *)data, *end = p + len;
+	uint64_t h;
+	
+	if(len >= 32) {
+		uint64_t v1 = seed + xxh_p1 + xxh_p2, v2 = seed + xxh_p2, v3 = seed, v4 = seed - xxh_p1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while(p + 32 <= end);
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+	}
+	else h = seed + xxh_p5;
+	
+	h += len;
+	for(; p + 8 <= end; p += 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * xxh_p1 + xxh_p4;
+	if(p + 4 <= end) { h = xxh_rotl(h ^ (xxh_read32(p) * xxh_p1), 23) * xxh_p2 + xxh_p3; p += 4; }
+	for(; p < end; p++) h = xxh_rotl(h ^ (*p * xxh_p5), 11) * xxh_p1;
+	
+	h ^= h >> 33; h *= xxh_p2;
+	h ^= h >> 29; h *= xxh_p3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Content hash of a whole file, read through mmap
+int hash_file(const char *path, uint64_t *hash)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	
+	if(fd == -1) return -1;
+	if(-1 == fstat(fd, &st)) { close(fd); return -1; }
+	if(st.st_size == 0) { *hash = xxh64("", 0, 0); close(fd); return 0; }
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	
+	*hash = xxh64(map, st.st_size, 0);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+// Maps the index file (created with dedup_min_capacity slots if missing)
+static int dedup_map(dedup_index *idx, const char *path, uint64_t capacity, int create)
+{
+	size_t size = sizeof(dedup_header) + capacity * sizeof(dedup_slot);
+	int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	struct stat st;
+	
+	if(fd == -1) return -1;
+	if(create && -1 == ftruncate(fd, size)) { close(fd); return -1; }
+	if(-1 == fstat(fd, &st) || (size_t)st.st_size < sizeof(dedup_header)) { close(fd); return -1; }
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) { close(fd); return -1; }
+	
+	dedup_header *hdr = (dedup_header *)map;
+	if(create) {
+		memcpy(hdr->magic, "DCMDEDUP", 8);
+		hdr->capacity = capacity;
+		hdr->count = 0;
+	}
+	else if(memcmp(hdr->magic, "DCMDEDUP", 8) != 0 ||
+	        (size_t)st.st_size != sizeof(dedup_header) + hdr->capacity * sizeof(dedup_slot)) {
+		cerr << "Error: " << path << " is not a dedup index" << endl;
+		munmap(map, st.st_size);
+		close(fd);
+		return -1;
+	}
+	
+	idx->fd       = fd;
+	idx->map_size = st.st_size;
+	idx->hdr      = hdr;
+	idx->slots    = (dedup_slot *)(hdr + 1);
+	return 0;
+}
+
+int dedup_open(dedup_index *idx, const char *path)
+{
+	idx->path = path;
+	if(0 == access(path, F_OK)) return dedup_map(idx, path, 0, 0);
+	return dedup_map(idx, path, dedup_min_capacity, 1);
+}
+
+void dedup_close(dedup_index *idx)
+{
+	msync(idx->hdr, idx->map_size, MS_SYNC);
+	munmap(idx->hdr, idx->map_size);
+	close(idx->fd);
+}
+
+// Slot holding the keys, or the free slot where they go
+static dedup_slot *dedup_find(dedup_index *idx, uint64_t uid_hash, uint64_t content_hash)
+{
+	uint64_t mask = idx->hdr->capacity - 1;
+	uint64_t i = (uid_hash ^ content_hash) & mask;
+	
+	while(idx->slots[i].uid_hash != 0 &&
+	      (idx->slots[i].uid_hash != uid_hash || idx->slots[i].content_hash != content_hash))
+		i = (i + 1) & mask;
+	return &idx->slots[i];
+}
+
+// Twice the slots, written next to the index and renamed over it
+static int dedup_grow(dedup_index *idx)
+{
+	dedup_index bigger;
+	string tmp = idx->path + ".tmp";
+	
+	if(-1 == dedup_map(&bigger, tmp.c_str(), idx->hdr->capacity * 2, 1)) return -1;
+	for(uint64_t i = 0; i < idx->hdr->capacity; i++) {
+		if(idx->slots[i].uid_hash == 0) continue;
+		*dedup_find(&bigger, idx->slots[i].uid_hash, idx->slots[i].content_hash) = idx->slots[i];
+		bigger.hdr->count++;
+	}
+	msync(bigger.hdr, bigger.map_size, MS_SYNC);
+	if(-1 == rename(tmp.c_str(), idx->path.c_str())) { dedup_close(&bigger); return -1; }
+	
+	dedup_close(idx);
+	idx->fd       = bigger.fd;
+	idx->map_size = bigger.map_size;
+	idx->hdr      = bigger.hdr;
+	idx->slots    = bigger.slots;
+	return 0;
+}
+
+// DEDUP_NONE, DEDUP_CONVERTED or DEDUP_UPLOADED
+int dedup_lookup(dedup_index *idx, uint64_t uid_hash, uint64_t content_hash)
+{
+	lock_guard<mutex> lock(idx->mtx);
+	if(uid_hash == 0) uid_hash = 1;		// 0 is the free slot
+	return dedup_find(idx, uid_hash, content_hash)->state;
+}
+
+int dedup_mark(dedup_index *idx, uint64_t uid_hash, uint64_t content_hash, int state, size_t jpeg_size)
+{
+	lock_guard<mutex> lock(idx->mtx);
+	if(uid_hash == 0) uid_hash = 1;
+	
+	// keep the load under 70%, probes stay short
+	if((idx->hdr->count + 1) * 10 > idx->hdr->capacity * 7 && -1 == dedup_grow(idx)) return -1;
+	
+	dedup_slot *slot = dedup_find(idx, uid_hash, content_hash);
+	if(slot->uid_hash == 0) {
+		slot->uid_hash     = uid_hash;
+		slot->content_hash = content_hash;
+		idx->hdr->count++;
+	}
+	slot->state = state;
+	if(jpeg_size) slot->jpeg_size = jpeg_size;
+	slot->stamp = time(NULL);
+	return 0;
+}
+
+// What a conversion depends on besides the DICOM bytes: the profile's search limits, the
+// progressive re-encode and the byte budget. The budget goes in quarter octave steps, so
+// the measured link rate moving a little doesn't empty the cache.
+uint64_t encode_settings_hash(const encode_profile *prof)
+{
+	long budget = profile_budget(prof);
+	int  bucket = 0;
+	char key[160];
+	
+	if(budget > 0) {
+		int e = 63 - __builtin_clzll(budget);
+		bucket = 1 + e * 4 + (e >= 2 ? (int)((budget >> (e - 2)) & 3) : 0);
+	}
+	int n = snprintf(key, sizeof(key), "%s %d %d %d %d %d %d", prof->name, prof->min_quality, prof->max_quality,
+	                 prof->max_downscale, prof->crop, progressive_full, bucket);
+	return xxh64(key, min(n, (int)sizeof(key) - 1), 0);
+}
+
+static string cache_path(dedup_index *idx, uint64_t content_hash, uint64_t settings)
+{
+	char name[48];
+	snprintf(name, sizeof(name), "/%016llx-%016llx.jpeg", (unsigned long long)content_hash, (unsigned long long)settings);
+	return idx->cache_dir + name;
+}
+
+// The JPEG of content_hash made with settings, -1 when there is none
+int cache_load(dedup_index *idx, uint64_t content_hash, uint64_t settings, mem_buf *jpg)
+{
+	string path = cache_path(idx, content_hash, settings);
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	
+	if(fd == -1) return -1;
+	if(-1 == fstat(fd, &st) || st.st_size == 0 || NULL == (jpg->data = (unsigned char *)malloc(st.st_size))) {
+		close(fd);
+		return -1;
+	}
+	jpg->size = st.st_size;
+	if(read(fd, jpg->data, jpg->size) != (ssize_t)jpg->size) {
+		free(jpg->data);
+		jpg->data = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// Written to a temp name and renamed, a crash never leaves half a JPEG behind
+int cache_store(dedup_index *idx, uint64_t content_hash, uint64_t settings, const mem_buf *jpg)
+{
+	string path = cache_path(idx, content_hash, settings), tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	
+	if(fd == -1) return -1;
+	if(write(fd, jpg->data, jpg->size) != (ssize_t)jpg->size || -1 == fsync(fd)) {
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	close(fd);
+	return rename(tmp.c_str(), path.c_str());
+}
+
+// Every JPEG of content_hash, whatever settings made it
+void cache_drop(dedup_index *idx, uint64_t content_hash)
+{
+	char prefix[24];
+	DIR *dir = opendir(idx->cache_dir.c_str());
+	struct dirent *de;
+	
+	if(!dir) return;
+	snprintf(prefix, sizeof(prefix), "%016llx-", (unsigned long long)content_hash);
+	while(NULL != (de = readdir(dir)))
+		if(0 == strncmp(de->d_name, prefix, 17)) unlink((idx->cache_dir + "/" + de->d_name).c_str());
+	closedir(dir);
+}
+
+// Appends one entry state to fd, fdatasync'ed when sync is set
+static int wq_write(int fd, const queue_entry *e, int sync)
+{
+	char buf[sizeof(journal_rec) + PATH_MAX];
+	journal_rec *rec = (journal_rec *)buf;
+	size_t len = min(e->path.size(), (size_t)PATH_MAX);
+	
+	memset(rec, 0, sizeof(journal_rec));
+	rec->magic    = 0x314A5144;		// "DQJ1"
+	rec->id       = e->id;
+	rec->state    = e->state;
+	rec->priority = e->priority;
+	rec->path_len = len;
+	rec->attempts = min(e->attempts, 255);
+	memcpy(buf + sizeof(journal_rec), e->path.data(), len);
+	rec->check = (uint32_t)xxh64(buf + 8, sizeof(journal_rec) - 8 + len, 0);
+	
+	if(write(fd, buf, sizeof(journal_rec) + len) != (ssize_t)(sizeof(journal_rec) + len)) return -1;
+	if(sync && -1 == fdatasync(fd)) return -1;
+	return 0;
+}
+
+// Applies the records of path to the queue. Stops at the first torn or corrupt record
+// (power cut mid write) and returns the offset of the good part, -1 if unreadable.
+static long wq_replay(work_queue *wq, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	long pos = 0;
+	
+	if(fd == -1) return (errno == ENOENT) ? 0 : -1;
+	if(-1 == fstat(fd, &st)) { close(fd); return -1; }
+	
+	vector<char> data(st.st_size);
+	if(st.st_size && read(fd, &data[0], st.st_size) != st.st_size) { close(fd); return -1; }
+	close(fd);
+	
+	while(pos + (long)sizeof(journal_rec) <= st.st_size) {
+		// records follow their paths, not aligned: the header is copied out
+		journal_rec rec;
+		memcpy(&rec, &data[pos], sizeof(rec));
+		long len = sizeof(journal_rec) + rec.path_len;
+		if(rec.magic != 0x314A5144 || pos + len > st.st_size ||
+		   rec.check != (uint32_t)xxh64(&data[pos + 8], len - 8, 0)) break;
+		
+		queue_entry e;
+		e.id         = rec.id;
+		e.state      = rec.state;
+		e.priority   = rec.priority;
+		e.attempts   = rec.attempts;
+		e.path.assign(&data[pos + sizeof(journal_rec)], rec.path_len);
+		e.not_before = 0;
+		
+		if(e.state == JOB_DONE || e.state == JOB_FAILED) {
+			if(wq->entries.count(e.id)) wq->paths.erase(wq->entries[e.id].path);
+			wq->entries.erase(e.id);
+		}
+		else {
+			wq->entries[e.id] = e;
+			wq->paths.insert(e.path);
+		}
+		if(e.id >= wq->next_id) wq->next_id = e.id + 1;
+		pos += len;
+	}
+	return pos;
+}
+
+// Loads dir/queue.index and dir/queue.journal. Entries that were being converted or
+// uploaded when the program stopped are pending again.
+int wq_open(work_queue *wq, const char *dir)
+{
+	wq->journal_path = string(dir) + "/queue.journal";
+	wq->index_path   = string(dir) + "/queue.index";
+	wq->next_id = 1;
+	wq->records = 0;
+	wq->closed  = false;
+	
+	if(-1 == wq_replay(wq, wq->index_path.c_str())) return -1;
+	long good = wq_replay(wq, wq->journal_path.c_str());
+	if(good == -1) return -1;
+	
+	wq->fd = open(wq->journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(wq->fd == -1) return -1;
+	if(-1 == ftruncate(wq->fd, good)) return -1;	// drop a torn tail
+	
+	for(map<uint64_t, queue_entry>::iterator it = wq->entries.begin(); it != wq->entries.end(); ++it)
+		it->second.state = JOB_PENDING;
+	
+	if(!wq->entries.empty()) cout << wq->entries.size() << " files still queued from the last run" << endl;
+	return 0;
+}
+
+void wq_close(work_queue *wq)
+{
+	fdatasync(wq->fd);
+	close(wq->fd);
+}
+
+// Folds the journal into a fresh index (temp file + rename), then empties the journal.
+// A crash in between replays index and journal, both hold whole entry states.
+static void wq_compact(work_queue *wq)
+{
+	string tmp = wq->index_path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	
+	if(fd == -1) return;
+	for(map<uint64_t, queue_entry>::iterator it = wq->entries.begin(); it != wq->entries.end(); ++it)
+		if(-1 == wq_write(fd, &it->second, 0)) { close(fd); unlink(tmp.c_str()); return; }
+	if(-1 == fdatasync(fd) || -1 == rename(tmp.c_str(), wq->index_path.c_str())) { close(fd); unlink(tmp.c_str()); return; }
+	close(fd);
+	
+	if(0 == ftruncate(wq->fd, 0)) {
+		fdatasync(wq->fd);
+		wq->records = 0;
+	}
+}
+
+// Journals e, called with wq->mtx held
+static void wq_log(work_queue *wq, const queue_entry *e, int sync)
+{
+	if(-1 == wq_write(wq->fd, e, sync)) perror("journal write error  !!!! ");
+	if(++wq->records > journal_compact_min && wq->records > 4 * (long)wq->entries.size()) wq_compact(wq);
+}
+
+// New pending entry for path, -1 if it is already queued
+int wq_add(work_queue *wq, const string &path, int priority)
+{
+	lock_guard<mutex> lock(wq->mtx);
+	if(wq->paths.count(path)) return -1;
+	
+	queue_entry e;
+	e.id         = wq->next_id++;
+	e.path       = path;
+	e.priority   = priority;
+	e.state      = JOB_PENDING;
+	e.attempts   = 0;
+	e.not_before = 0;
+	wq->entries[e.id] = e;
+	wq->paths.insert(path);
+	wq_log(wq, &e, 1);
+	
+	wq->cv.notify_one();
+	return 0;
+}
+
+// Waits for the next pending entry, STAT before routine, oldest first, and marks it
+// converting. false once the queue is shut down.
+bool wq_take(work_queue *wq, queue_entry *out)
+{
+	unique_lock<mutex> lock(wq->mtx);
+	
+	while(!wq->closed) {
+		time_t now = time(NULL);
+		queue_entry *best = NULL;
+		for(map<uint64_t, queue_entry>::iterator it = wq->entries.begin(); it != wq->entries.end(); ++it) {
+			queue_entry &e = it->second;
+			if(e.state != JOB_PENDING || e.not_before > now) continue;
+			if(best == NULL || e.priority > best->priority) best = &e;
+		}
+		if(best) {
+			best->state = JOB_CONVERTING;
+			wq_log(wq, best, 0);
+			*out = *best;
+			return true;
+		}
+		// retries become due without anybody calling notify
+		wq->cv.wait_for(lock, chrono::seconds(1));
+	}
+	return false;
+}
+
+// Converting / uploading are not synced, after a crash they are pending anyway
+void wq_set_state(work_queue *wq, uint64_t id, int state)
+{
+	lock_guard<mutex> lock(wq->mtx);
+	map<uint64_t, queue_entry>::iterator it = wq->entries.find(id);
+	if(it == wq->entries.end() || it->second.state == state) return;
+	
+	it->second.state = state;
+	wq_log(wq, &it->second, state == JOB_DONE || state == JOB_FAILED);
+	if(state == JOB_DONE || state == JOB_FAILED) {
+		wq->paths.erase(it->second.path);
+		wq->entries.erase(it);
+	}
+}
+
+// Back to pending after a failed upload, not taken again for link_retry_min seconds,
+// doubling with each attempt up to link_retry_max. Returns the delay, -1 once the entry
+// failed upload_attempts_max times: it is left as it is, for the caller to give up.
+int wq_retry(work_queue *wq, uint64_t id)
+{
+	lock_guard<mutex> lock(wq->mtx);
+	map<uint64_t, queue_entry>::iterator it = wq->entries.find(id);
+	if(it == wq->entries.end() || it->second.attempts + 1 >= upload_attempts_max) return -1;
+	
+	int delay = min(link_retry_min << min(it->second.attempts, 5), link_retry_max);
+	it->second.attempts++;
+	it->second.state      = JOB_PENDING;
+	it->second.not_before = time(NULL) + delay;
+	wq_log(wq, &it->second, 1);
+	wq->cv.notify_one();
+	return delay;
+}
+
+void wq_shutdown(work_queue *wq)
+{
+	lock_guard<mutex> lock(wq->mtx);
+	wq->closed = true;
+	wq->cv.notify_all();
+}
+
+// Moves a finished spool file out of the way, into done/ or failed/
+void retire_spool_file(const char *dir, const string &path, int failed)
+{
+	string dest = string(dir) + (failed ? "/failed/" : "/done/") + path.substr(path.rfind('/') + 1);
+	
+	if(-1 == rename(path.c_str(), dest.c_str())) perror("spool rename error  !!!! ");
+	cout << path << (failed ? " FAILED" : " done") << endl;
+}
+
+// One frame of an already loaded file to JPEG: passed through when it is a browser
+// readable JPEG, windowed by render_mono_8bit() for plain greyscale, by DicomImage otherwise.
+// Only that frame's pixels are read when the file was loaded with lazy pixel data.
+int convert_frame(DcmFileFormat *fileformat, unsigned long frame, mem_buf *jpg)
+{
+    DcmDataset *dset = fileformat->getDataset();
+    
+    // already a browser readable JPEG, send the encapsulated stream as it is
+    // unless it is over the profile's budget
+    if (is_jpeg_passthrough(dset))
+    {
+      long budget = profile_budget(enc_profile);
+      if (0 == extract_jpeg_frame(dset, frame, jpg))
+      {
+        if (budget == 0 || (long)jpg->size <= budget)
+        {
+          cout << "DCM File already JPEG, passed through (" << jpg->size << " bytes)" << endl;
+          return 0;
+        }
+        cout << "Encapsulated JPEG over budget (" << jpg->size << " > " << budget << " bytes), re-encoding" << endl;
+        free(jpg->data);
+        jpg->data = NULL;
+      }
+      else
+        cerr << "Error: cannot extract JPEG fragments, converting instead" << endl;
+    }
+
+    // plain 16 bit greyscale is windowed with our own kernel, everything else by DicomImage
+    mem_buf pix = {NULL, 0};
+    int width = 0, height = 0, ret;
+    encode_result res;
+    if (0 == render_mono_8bit(dset, frame, &pix, &width, &height))
+    {
+      ret = encode_profiled(pix.data, width, height, 1, enc_profile, jpg, &res);
+      free(pix.data);
+    }
+    else
+    {
+      DicomImage image(fileformat, dset->getOriginalXfer(),
+                       CIF_MayDetachPixelData | CIF_UsePartialAccessToPixelData, frame, 1);
+      if (image.getStatus() != EIS_Normal)
+      {
+        cerr << "Error: cannot render DICOM image (" << DicomImage::getString(image.getStatus()) << ")" << endl;
+        return -1;
+      }
+
+      // windowed like the kernel path: first VOI window when the file has one, full range otherwise
+      if (image.isMonochrome() && image.getWindowCount() > 0)
+        image.setWindow(0);
+
+      const unsigned char *out = (const unsigned char *)image.getOutputData(8);
+      if (out == NULL)
+      {
+        cerr << "Error: cannot render DICOM image to 8 bit" << endl;
+        return -1;
+      }
+      ret = encode_profiled(out, image.getWidth(), image.getHeight(),
+                            image.isMonochrome() ? 1 : 3, enc_profile, jpg, &res);
+    }
+
+    if (ret == -1)
+    {
+      cerr << "Error in conversion of DCM to JPEG" << endl;
+      return -1;
+    }
+    cout << "DCM File Converted to JPEG successfully (" << jpg->size << " bytes)" << endl;
+    cout << "Profile " << enc_profile->name << ": quality " << res.quality << ", "
+         << res.width << "x" << res.height << " (1/" << (1 << res.downscale) << ")";
+    if (res.budget) cout << ", budget " << res.budget << " bytes";
+    if (res.seconds > 0) cout << ", ~" << (int)res.seconds << " s on the link";
+    cout << endl;
+      
+    return 0;
+}
+
+// JPEG baseline and extended (8 bit only, browsers don't decode 12 bit) can go out unchanged
+bool is_jpeg_passthrough(DcmDataset *dset)
+{
+	E_TransferSyntax xfer = dset->getOriginalXfer();
+	Uint16 bits_stored = 0;
+	
+	if(xfer != EXS_JPEGProcess1 && xfer != EXS_JPEGProcess2_4) return false;
+	if(dset->findAndGetUint16(DCM_BitsStored, bits_stored).bad() || bits_stored > 8) return false;
+	
+	return true;
+}
+
+// Copies the fragments of frame 'frame' out of the encapsulated pixel data into jpg (malloc'ed).
+// Item 0 is the offset table, every frame starts on a fragment beginning with the SOI marker.
+// Fragments are read with getPartialValue(), so none of them stays loaded in the dataset.
+int extract_jpeg_frame(DcmDataset *dset, unsigned long frame, mem_buf *jpg)
+{
+	DcmElement *elem = NULL;
+	if(dset->findAndGetElement(DCM_PixelData, elem).bad() || elem == NULL) return -1;
+	
+	DcmPixelData *pixdata = OFstatic_cast(DcmPixelData *, elem);
+	DcmPixelSequence *pixseq = NULL;
+	const DcmRepresentationParameter *rep = NULL;
+	E_TransferSyntax xfer = EXS_Unknown;
+	
+	pixdata->getOriginalRepresentationKey(xfer, rep);
+	if(pixdata->getEncapsulatedRepresentation(xfer, rep, pixseq).bad() || pixseq == NULL) return -1;
+	
+	// first pass finds the fragments of the frame, second pass copies them
+	unsigned long first = 0, last = 0, i;
+	long cur_frame = -1;
+	size_t size = 0;
+	DcmPixelItem *item = NULL;
+	Uint8 soi[2];
+	
+	for(i = 1; i < pixseq->card(); i++) {
+		if(pixseq->getItem(item, i).bad()) return -1;
+		if(item->getLength() >= 2 && item->getPartialValue(soi, 0, 2).good() && soi[0] == 0xFF && soi[1] == 0xD8) {
+			if(cur_frame == (long)frame) break;
+			cur_frame++;
+			if(cur_frame == (long)frame) first = i;
+		}
+		if(cur_frame == (long)frame) { last = i; size += item->getLength(); }
+	}
+	if(first == 0 || size == 0) return -1;
+	
+	jpg->data = (unsigned char *)malloc(size);
+	if(jpg->data == NULL) return -1;
+	jpg->size = 0;
+	
+	for(i = first; i <= last; i++) {
+		if(pixseq->getItem(item, i).bad() || item->getPartialValue(jpg->data + jpg->size, 0, item->getLength()).bad()) {
+			free(jpg->data);
+			jpg->data = NULL;
+			return -1;
+		}
+		jpg->size += item->getLength();
+	}
+	
+	return 0;
+}
+
+// Folds rescale slope/intercept and the DICOM linear VOI function
+//   y = ((m - (center - 0.5)) / (width - 1) + 0.5) * 255,  m = slope * x + intercept
+// into y = a * x + b, and that into the fixed point voi_map.
+int setup_voi_map(voi_map *m, int bits, int is_signed, double slope, double intercept,
+                  double center, double width, int invert)
+{
+	if(bits < 1 || bits > 16) return -1;
+	if(width < 2) width = 2;	// width 1 is a threshold, keep the map linear
+	
+	double a = slope * 255.0 / (width - 1);
+	double b = ((intercept - (center - 0.5)) / (width - 1) + 0.5) * 255.0;
+	if(a < 0) { a = -a; b = 255.0 - b; invert = !invert; }
+	
+	double xmin = is_signed ? -ldexp(1.0, bits - 1) : 0;
+	double xmax = is_signed ? ldexp(1.0, bits - 1) - 1 : ldexp(1.0, bits) - 1;
+	
+	// last value still below 0 and first value saturating at 255, y = floor(a * x + b + 0.5)
+	double lo = (a > 0) ? ceil(-(b + 0.5) / a) - 1 : xmin;
+	double hi = (a > 0) ? floor((255.5 - b) / a) + 1 : xmin;
+	if(lo < xmin) lo = xmin;
+	if(lo > xmax) lo = xmax;
+	if(hi < lo)   hi = lo;
+	if(hi > xmax) hi = xmax;
+	
+	double v0 = a * lo + b + 0.5;
+	if(hi == lo) {
+		// constant output, keep add in range
+		a = 0;
+		if(v0 < -1)  v0 = -1;
+		if(v0 > 256) v0 = 256;
+	}
+	
+	// most fraction bits with mul in 16 bits, 22 keeps (span * mul + add) below 2^31
+	int frac = 22;
+	while(frac > 0 && floor(a * ldexp(1.0, frac) + 0.5) > 65535) frac--;
+	double mul = floor(a * ldexp(1.0, frac) + 0.5);
+	if(mul > 65535) mul = 65535;
+	
+	m->is_signed = is_signed;
+	m->shift  = 16 - bits;
+	m->mask   = (Uint16)((1UL << bits) - 1);
+	m->lo     = (Uint16)((long)lo + (is_signed ? 0x8000 : 0));
+	m->span   = (Uint16)((long)hi - (long)lo);
+	m->mul    = (Uint32)mul;
+	m->add    = (Sint32)floor(v0 * ldexp(1.0, frac) + 0.5);
+	m->frac   = frac;
+	m->invert = invert ? 1 : 0;
+	
+	return 0;
+}
+
+// Reference kernel, also does the tails of the SIMD one
+void voi_rescale_scalar(const voi_map *m, const Uint16 *src, unsigned char *dst, size_t n)
+{
+	for(size_t i = 0; i < n; i++) {
+		Uint16 u;
+		if(m->is_signed) u = (Uint16)((Sint16)(Uint16)(src[i] << m->shift) >> m->shift) ^ 0x8000;
+		else             u = src[i] & m->mask;
+		
+		Uint32 d = (u > m->lo) ? (Uint32)(u - m->lo) : 0;
+		if(d > m->span) d = m->span;
+		
+		Sint32 y = ((Sint32)(d * m->mul) + m->add) >> m->frac;
+		if(y < 0)   y = 0;
+		if(y > 255) y = 255;
+		
+		dst[i] = m->invert ? (unsigned char)(255 - y) : (unsigned char)y;
+	}
+}
+
+// Same arithmetic as voi_rescale_scalar(), 8 (NEON), 16 (SSE2) or 32 (AVX2) pixels a step
+void voi_rescale(const voi_map *m, const Uint16 *src, unsigned char *dst, size_t n)
+{
+	size_t i = 0;
+	
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const int16x8_t  shl   = vdupq_n_s16(m->shift);
+	const int16x8_t  shr   = vdupq_n_s16(-m->shift);
+	const uint16x8_t bias  = vdupq_n_u16(m->is_signed ? 0x8000 : 0);
+	const uint16x8_t mask  = vdupq_n_u16(m->is_signed ? 0xFFFF : m->mask);
+	const uint16x8_t lo    = vdupq_n_u16(m->lo);
+	const uint16x8_t span  = vdupq_n_u16(m->span);
+	const uint16x4_t mul   = vdup_n_u16((Uint16)m->mul);
+	const uint32x4_t add   = vdupq_n_u32((Uint32)m->add);
+	const int32x4_t  frac  = vdupq_n_s32(-m->frac);
+	
+	for(; i + 8 <= n; i += 8) {
+		uint16x8_t u = vld1q_u16(src + i);
+		if(m->is_signed) u = veorq_u16(vreinterpretq_u16_s16(vshlq_s16(vshlq_s16(vreinterpretq_s16_u16(u), shl), shr)), bias);
+		else             u = vandq_u16(u, mask);
+		
+		uint16x8_t d  = vminq_u16(vqsubq_u16(u, lo), span);
+		int32x4_t  t0 = vreinterpretq_s32_u32(vmlal_u16(add, vget_low_u16(d), mul));
+		int32x4_t  t1 = vreinterpretq_s32_u32(vmlal_u16(add, vget_high_u16(d), mul));
+		t0 = vshlq_s32(t0, frac);
+		t1 = vshlq_s32(t1, frac);
+		
+		uint8x8_t y = vqmovn_u16(vcombine_u16(vqmovun_s32(t0), vqmovun_s32(t1)));
+		if(m->invert) y = vmvn_u8(y);
+		vst1_u8(dst + i, y);
+	}
+#elif defined(__AVX2__)
+	const __m128i  shift = _mm_cvtsi32_si128(m->shift);
+	const __m128i  frac  = _mm_cvtsi32_si128(m->frac);
+	const __m256i  bias  = _mm256_set1_epi16((short)0x8000);
+	const __m256i  mask  = _mm256_set1_epi16((short)m->mask);
+	const __m256i  lo    = _mm256_set1_epi16((short)m->lo);
+	const __m256i  span  = _mm256_set1_epi16((short)m->span);
+	const __m256i  mul   = _mm256_set1_epi16((short)m->mul);
+	const __m256i  add   = _mm256_set1_epi32(m->add);
+	const __m256i  inv   = _mm256_set1_epi8(m->invert ? (char)0xFF : 0);
+	__m256i y16[2];
+	
+	for(; i + 32 <= n; i += 32) {
+		for(int k = 0; k < 2; k++) {
+			__m256i u = _mm256_loadu_si256((const __m256i *)(src + i + 16 * k));
+			if(m->is_signed) u = _mm256_xor_si256(_mm256_sra_epi16(_mm256_sll_epi16(u, shift), shift), bias);
+			else             u = _mm256_and_si256(u, mask);
+			
+			__m256i d  = _mm256_min_epu16(_mm256_subs_epu16(u, lo), span);
+			__m256i pl = _mm256_mullo_epi16(d, mul);
+			__m256i ph = _mm256_mulhi_epu16(d, mul);
+			__m256i t0 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(pl, ph), add), frac);
+			__m256i t1 = _mm256_sra_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(pl, ph), add), frac);
+			y16[k] = _mm256_packs_epi32(t0, t1);
+		}
+		// packs work per 128 bit lane, put the quadwords back in pixel order
+		__m256i y = _mm256_permute4x64_epi64(_mm256_packus_epi16(y16[0], y16[1]), 0xD8);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(y, inv));
+	}
+#elif defined(__SSE2__)
+	const __m128i  shift = _mm_cvtsi32_si128(m->shift);
+	const __m128i  frac  = _mm_cvtsi32_si128(m->frac);
+	const __m128i  bias  = _mm_set1_epi16((short)0x8000);
+	const __m128i  mask  = _mm_set1_epi16((short)m->mask);
+	const __m128i  lo    = _mm_set1_epi16((short)m->lo);
+	const __m128i  span  = _mm_set1_epi16((short)m->span);
+	const __m128i  mul   = _mm_set1_epi16((short)m->mul);
+	const __m128i  add   = _mm_set1_epi32(m->add);
+	const __m128i  inv   = _mm_set1_epi8(m->invert ? (char)0xFF : 0);
+	__m128i y16[2];
+	
+	for(; i + 16 <= n; i += 16) {
+		for(int k = 0; k < 2; k++) {
+			__m128i u = _mm_loadu_si128((const __m128i *)(src + i + 8 * k));
+			if(m->is_signed) u = _mm_xor_si128(_mm_sra_epi16(_mm_sll_epi16(u, shift), shift), bias);
+			else             u = _mm_and_si128(u, mask);
+			
+			// SSE2 has no unsigned 16 bit min: min(d, span) = d - sat(d - span)
+			__m128i d  = _mm_subs_epu16(u, lo);
+			d = _mm_sub_epi16(d, _mm_subs_epu16(d, span));
+			__m128i pl = _mm_mullo_epi16(d, mul);
+			__m128i ph = _mm_mulhi_epu16(d, mul);
+			__m128i t0 = _mm_sra_epi32(_mm_add_epi32(_mm_unpacklo_epi16(pl, ph), add), frac);
+			__m128i t1 = _mm_sra_epi32(_mm_add_epi32(_mm_unpackhi_epi16(pl, ph), add), frac);
+			y16[k] = _mm_packs_epi32(t0, t1);
+		}
+		__m128i y = _mm_packus_epi16(y16[0], y16[1]);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(y, inv));
+	}
+#endif
+	
+	voi_rescale_scalar(m, src + i, dst + i, n - i);
+}
+
+// Uncompressed 16 bit MONOCHROME1/2 frames only. Returns -1 for anything else
+// (colour, 8 bit, encapsulated) and the caller falls back to DicomImage.
+// Only the requested frame is read, the rest of the pixel data can stay in the file.
+int render_mono_8bit(DcmDataset *dset, unsigned long frame, mem_buf *pix, int *width, int *height)
+{
+	Uint16 rows = 0, cols = 0, spp = 0, bits_alloc = 0, bits_stored = 0, high_bit = 0, pixrep = 0;
+	Float64 slope = 1.0, intercept = 0.0, center = 0.0, win_width = 0.0;
+	OFString photometric, color_model;
+	DcmElement *pixdata = NULL;
+	long frames = 1;
+	Uint32 start = 0;
+	
+	if(DcmXfer(dset->getOriginalXfer()).isEncapsulated()) return -1;
+	
+	dset->findAndGetUint16(DCM_Rows, rows);
+	dset->findAndGetUint16(DCM_Columns, cols);
+	dset->findAndGetUint16(DCM_SamplesPerPixel, spp);
+	dset->findAndGetUint16(DCM_BitsAllocated, bits_alloc);
+	dset->findAndGetUint16(DCM_BitsStored, bits_stored);
+	dset->findAndGetUint16(DCM_HighBit, high_bit);
+	dset->findAndGetUint16(DCM_PixelRepresentation, pixrep);
+	dset->findAndGetOFString(DCM_PhotometricInterpretation, photometric);
+	dset->findAndGetLongInt(DCM_NumberOfFrames, frames);
+	
+	if(rows == 0 || cols == 0 || spp != 1 || bits_alloc != 16) return -1;
+	if(bits_stored == 0 || bits_stored > 16 || high_bit != bits_stored - 1) return -1;
+	if(photometric != "MONOCHROME1" && photometric != "MONOCHROME2") return -1;
+	
+	if((long)frame >= (frames < 1 ? 1 : frames)) return -1;
+	if(dset->findAndGetElement(DCM_PixelData, pixdata).bad() || pixdata == NULL) return -1;
+	
+	size_t npix = (size_t)rows * cols;
+	Uint16 *raw = (Uint16 *)malloc(npix * sizeof(Uint16));
+	if(raw == NULL) return -1;
+	if(pixdata->getUncompressedFrame(dset, frame, start, raw, npix * sizeof(Uint16), color_model).bad()) {
+		free(raw);
+		return -1;
+	}
+	
+	dset->findAndGetFloat64(DCM_RescaleSlope, slope);
+	dset->findAndGetFloat64(DCM_RescaleIntercept, intercept);
+	
+	// first VOI window, or the full stored range like dcmj2pnm without windowing
+	if(dset->findAndGetFloat64(DCM_WindowCenter, center).bad() ||
+	   dset->findAndGetFloat64(DCM_WindowWidth, win_width).bad() || win_width <= 0) {
+		double xmin = pixrep ? -ldexp(1.0, bits_stored - 1) : 0;
+		double xmax = pixrep ? ldexp(1.0, bits_stored - 1) - 1 : ldexp(1.0, bits_stored) - 1;
+		double mmin = slope * xmin + intercept, mmax = slope * xmax + intercept;
+		if(mmin > mmax) { double t = mmin; mmin = mmax; mmax = t; }
+		win_width = mmax - mmin + 1;
+		center    = mmin + 0.5 + (mmax - mmin) / 2;
+	}
+	
+	voi_map map;
+	if(-1 == setup_voi_map(&map, bits_stored, pixrep, slope, intercept, center, win_width,
+	                       photometric == "MONOCHROME1") ||
+	   NULL == (pix->data = (unsigned char *)malloc(npix))) {
+		free(raw);
+		return -1;
+	}
+	pix->size = npix;
+	
+	voi_rescale(&map, raw, pix->data, npix);
+	free(raw);
+	
+	*width  = cols;
+	*height = rows;
+	return 0;
+}
+
+// libjpeg calls error_exit() on failure, which exits by default. Jump back instead.
+// Locals changed after setjmp() are unreliable after the jump, what is to be freed then
+// is kept in buf: encode_jpeg's output, make_preview's pixels.
+struct jpeg_err {
+	struct jpeg_error_mgr       mgr;
+	jmp_buf                     jump;
+	mem_buf                     buf;
+	struct jpeg_destination_mgr dest;	// encode_jpeg's, writes to buf
+};
+
+static void jpeg_err_exit(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((jpeg_err *)cinfo->err)->jump, 1);
+}
+
+// Destination of encode_jpeg, buf doubled whenever it is full. jpeg_mem_dest() can't be
+// used: it moves to a new buffer as it grows and tells where only at the end.
+static boolean jpeg_buf_grow(j_compress_ptr cinfo)
+{
+	jpeg_err *err = (jpeg_err *)cinfo->err;
+	size_t size = err->buf.size ? 2 * err->buf.size : 65536;
+	unsigned char *data = (unsigned char *)realloc(err->buf.data, size);
+	
+	if(data == NULL) {
+		perror("malloc error  !!!! ");
+		longjmp(err->jump, 1);
+	}
+	err->dest.next_output_byte = data + err->buf.size;
+	err->dest.free_in_buffer   = size - err->buf.size;
+	err->buf.data = data;
+	err->buf.size = size;
+	return TRUE;
+}
+
+static void jpeg_buf_init(j_compress_ptr cinfo)
+{
+	jpeg_buf_grow(cinfo);
+}
+
+static void jpeg_buf_term(j_compress_ptr cinfo)
+{
+	jpeg_err *err = (jpeg_err *)cinfo->err;
+	err->buf.size -= err->dest.free_in_buffer;
+	unsigned char *data = (unsigned char *)realloc(err->buf.data, err->buf.size);
+	if(data) err->buf.data = data;
+}
+
+// Encodes 8 bit greyscale (components 1) or RGB (components 3) pixels into jpg (malloc'ed).
+// restart is the restart interval in MCUs, 0 for none. progressive gives a JPEG that
+// browsers draw coarse first and refine while it downloads.
+int encode_jpeg(const unsigned char *pix, int width, int height, int components, int quality,
+                unsigned int restart, int progressive, mem_buf *jpg)
+{
+	struct jpeg_compress_struct cinfo;
+	jpeg_err       err;
+	
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_err_exit;
+	err.buf.data = NULL;
+	err.buf.size = 0;
+	if(setjmp(err.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		free(err.buf.data);
+		return -1;
+	}
+	
+	jpeg_create_compress(&cinfo);
+	err.dest.init_destination    = jpeg_buf_init;
+	err.dest.empty_output_buffer = jpeg_buf_grow;
+	err.dest.term_destination    = jpeg_buf_term;
+	cinfo.dest = &err.dest;
+	
+	cinfo.image_width      = width;
+	cinfo.image_height     = height;
+	cinfo.input_components = components;
+	cinfo.in_color_space   = (components == 3) ? JCS_RGB : JCS_GRAYSCALE;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	if(components == 3) {
+		// 4:2:2, as dcmj2pnm, MCU is 16x8
+		cinfo.comp_info[0].h_samp_factor = 2;
+		cinfo.comp_info[0].v_samp_factor = 1;
+	}
+	// standard Huffman tables, so independently encoded bands share them
+	cinfo.optimize_coding  = FALSE;
+	cinfo.restart_interval = restart;
+	if(progressive) jpeg_simple_progression(&cinfo);
+	
+	jpeg_start_compress(&cinfo, TRUE);
+	while(cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row = (JSAMPROW)(pix + (size_t)cinfo.next_scanline * width * components);
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	
+	*jpg = err.buf;
+	return 0;
+}
+
+// Offset of the entropy coded data (after the SOS header), and of the SOF marker
+static int jpeg_find_scan(const mem_buf *jpg, size_t *sof, size_t *scan)
+{
+	size_t pos = 2;	// after SOI
+	*sof = 0;
+	
+	while(pos + 4 <= jpg->size && jpg->data[pos] == 0xFF) {
+		unsigned char marker = jpg->data[pos + 1];
+		size_t len = (jpg->data[pos + 2] << 8) | jpg->data[pos + 3];
+		if(marker == 0xC0 || marker == 0xC1) *sof = pos;
+		if(marker == 0xDA) {
+			*scan = pos + 2 + len;
+			return (*sof && *scan < jpg->size) ? 0 : -1;
+		}
+		pos += 2 + len;
+	}
+	return -1;
+}
+
+// Splits the image into bands of whole MCU rows and encodes each band on its own thread,
+// with the restart interval set to the MCUs of one band. Every band then ends exactly
+// where a restart marker belongs, so the stitched result is
+//   header of band 0 (height patched) + scan 0 + RST0 + scan 1 + RST1 ... + EOI
+// a plain baseline JPEG any browser opens.
+// Progressive scans span the whole image and can't be cut into bands, those use one thread.
+int encode_jpeg_parallel(const unsigned char *pix, int width, int height, int components, int quality,
+                         int progressive, mem_buf *jpg)
+{
+	int threads = thread::hardware_concurrency();
+	
+	if(progressive || threads < 2 || (long)width * height < parallel_min_pixels)
+		return encode_jpeg(pix, width, height, components, quality, 0, progressive, jpg);
+	
+	// 8 lines per MCU row in both layouts, 8 (grey) or 16 (4:2:2) columns per MCU
+	const int mcu_h = 8, mcu_w = (components == 3) ? 16 : 8;
+	long mcus_per_row = (width + mcu_w - 1) / mcu_w;
+	long mcu_rows     = (height + mcu_h - 1) / mcu_h;
+	
+	// restart interval is 16 bits, more bands than threads if one band gets bigger
+	long bands = threads;
+	if(mcu_rows * mcus_per_row / bands > 65535) bands = (mcu_rows * mcus_per_row + 65534) / 65535;
+	long band_mcu_rows = (mcu_rows + bands - 1) / bands;
+	bands = (mcu_rows + band_mcu_rows - 1) / band_mcu_rows;
+	
+	int band_h = band_mcu_rows * mcu_h;
+	unsigned int restart = band_mcu_rows * mcus_per_row;
+	vector<mem_buf> out(bands);
+	vector<int>     res(bands, -1);
+	atomic<long>    next(0);
+	
+	vector<thread> pool;
+	for(int t = 0; t < threads && t < bands; t++) {
+		pool.push_back(thread([&]() {
+			long b;
+			while((b = next++) < bands) {
+				int rows = min(band_h, height - (int)b * band_h);
+				out[b].data = NULL;
+				res[b] = encode_jpeg(pix + (size_t)b * band_h * width * components, width, rows,
+				                     components, quality, restart, 0, &out[b]);
+			}
+		}));
+	}
+	for(size_t t = 0; t < pool.size(); t++) pool[t].join();
+	
+	// stitch the scans
+	size_t total = 0, sof = 0, scan = 0;
+	vector<size_t> scans(bands);
+	int ret = 0;
+	for(long b = 0; b < bands; b++) {
+		if(res[b] == -1 || -1 == jpeg_find_scan(&out[b], &sof, &scans[b])) { ret = -1; break; }
+		total += out[b].size - scans[b];	// scan + EOI, or RSTn in its place
+	}
+	
+	if(ret == 0) {
+		jpg->data = (unsigned char *)malloc(scans[0] + total);
+		if(jpg->data == NULL) ret = -1;
+	}
+	if(ret == 0) {
+		jpeg_find_scan(&out[0], &sof, &scan);
+		memcpy(jpg->data, out[0].data, scans[0]);
+		jpg->data[sof + 5] = height >> 8;		// Y in the SOF of the full image
+		jpg->data[sof + 6] = height & 0xFF;
+		jpg->size = scans[0];
+		
+		for(long b = 0; b < bands; b++) {
+			size_t len = out[b].size - scans[b] - 2;
+			memcpy(jpg->data + jpg->size, out[b].data + scans[b], len);
+			jpg->size += len;
+			jpg->data[jpg->size++] = 0xFF;
+			jpg->data[jpg->size++] = (b == bands - 1) ? 0xD9 : 0xD0 + (b & 7);
+		}
+	}
+	
+	for(long b = 0; b < bands; b++) free(out[b].data);
+	return ret;
+}
+
+const encode_profile *find_profile(const char *name)
+{
+	for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+		if(0 == strcmp(profiles[i].name, name)) return &profiles[i];
+	return NULL;
+}
+
+// Smallest of the byte budget and max_seconds at the link rate, 0 when unlimited
+long profile_budget(const encode_profile *prof)
+{
+	long   budget = prof->target_bytes;
+	double rate   = (link_rate > 0) ? link_rate.load() : prof->link_rate;
+	
+	if(prof->max_seconds > 0 && rate > 0) {
+		long b = (long)(prof->max_seconds * rate);
+		if(budget == 0 || b < budget) budget = b;
+	}
+	return budget;
+}
+
+// true when all samples of the strip are within roi_flat_tol of each other
+static bool is_flat(const unsigned char *p, int count, int stride)
+{
+	unsigned char lo = 255, hi = 0;
+	for(int i = 0; i < count; i++, p += stride) {
+		if(*p < lo) lo = *p;
+		if(*p > hi) hi = *p;
+	}
+	return hi - lo <= roi_flat_tol;
+}
+
+// Trims flat rows/columns at the edges into a new buffer. Returns -1 if there is nothing to trim.
+static int crop_flat_borders(const unsigned char *pix, int width, int height, int comps,
+                             mem_buf *out, int *out_w, int *out_h)
+{
+	int row = width * comps;
+	int y0 = 0, y1 = height, x0 = 0, x1 = width;
+	
+	while(y0 < y1 - 1 && is_flat(pix + (size_t)y0 * row, row, 1)) y0++;
+	while(y1 - 1 > y0 && is_flat(pix + (size_t)(y1 - 1) * row, row, 1)) y1--;
+	while(x0 < x1 - 1 && is_flat(pix + (size_t)y0 * row + x0 * comps, y1 - y0, row)) x0++;
+	while(x1 - 1 > x0 && is_flat(pix + (size_t)y0 * row + (x1 - 1) * comps, y1 - y0, row)) x1--;
+	
+	// not worth a copy below 10% of the area
+	if((long)(x1 - x0) * (y1 - y0) * 10 > (long)width * height * 9) return -1;
+	
+	out->size = (size_t)(x1 - x0) * (y1 - y0) * comps;
+	out->data = (unsigned char *)malloc(out->size);
+	if(out->data == NULL) return -1;
+	
+	for(int y = y0; y < y1; y++)
+		memcpy(out->data + (size_t)(y - y0) * (x1 - x0) * comps, pix + (size_t)y * row + x0 * comps, (x1 - x0) * comps);
+	*out_w = x1 - x0;
+	*out_h = y1 - y0;
+	return 0;
+}
+
+// Half resolution, 2x2 box filter, into a new buffer
+static int downscale_half(const unsigned char *pix, int width, int height, int comps,
+                          mem_buf *out, int *out_w, int *out_h)
+{
+	int w = width / 2, h = height / 2, row = width * comps;
+	if(w < 1 || h < 1) return -1;
+	
+	out->size = (size_t)w * h * comps;
+	out->data = (unsigned char *)malloc(out->size);
+	if(out->data == NULL) return -1;
+	
+	for(int y = 0; y < h; y++) {
+		const unsigned char *s0 = pix + (size_t)2 * y * row, *s1 = s0 + row;
+		unsigned char *d = out->data + (size_t)y * w * comps;
+		for(int x = 0; x < w; x++, s0 += comps, s1 += comps)
+			for(int c = 0; c < comps; c++, d++, s0++, s1++)
+				*d = (s0[0] + s0[comps] + s1[0] + s1[comps] + 2) >> 2;
+	}
+	*out_w = w;
+	*out_h = h;
+	return 0;
+}
+
+// Encodes with the profile: the highest quality in [min_quality, max_quality] that fits the
+// budget, at full resolution if possible, else at 1/2, 1/4 .. up to max_downscale halvings.
+// If nothing fits, the smallest attempt is kept. The choice is reported in res.
+// The search encodes baseline, in parallel bands. With progressive_full and no budget there
+// is nothing to search, the one encode is progressive right away; with a budget the chosen
+// attempt is encoded again as progressive and kept if that is smaller.
+int encode_profiled(const unsigned char *pix, int width, int height, int comps,
+                    const encode_profile *prof, mem_buf *jpg, encode_result *res)
+{
+	long budget = profile_budget(prof);
+	mem_buf cur = {NULL, 0}, next = {NULL, 0}, best = {NULL, 0}, tmp;
+	const unsigned char *src = pix;
+	int w = width, h = height, nw, nh, scale;
+	
+	res->budget = budget;
+	res->quality = prof->max_quality;
+	res->downscale = 0;
+	
+	if(prof->crop && 0 == crop_flat_borders(src, w, h, comps, &cur, &nw, &nh)) {
+		src = cur.data; w = nw; h = nh;
+	}
+	
+	if(progressive_full && budget == 0) {
+		if(-1 == encode_jpeg(src, w, h, comps, prof->max_quality, 0, 1, &best)) { free(cur.data); return -1; }
+		res->width = w; res->height = h;
+	}
+	else for(scale = 0; ; scale++) {
+		// binary search on quality, the first try at max_quality usually fits
+		int lo = prof->min_quality, hi = prof->max_quality, q = hi;
+		while(lo <= hi) {
+			if(-1 == encode_jpeg_parallel(src, w, h, comps, q, 0, &tmp)) { free(cur.data); free(best.data); return -1; }
+			bool fits = (budget == 0 || (long)tmp.size <= budget);
+			if(fits || best.data == NULL || tmp.size < best.size) {
+				free(best.data);
+				best = tmp;
+				res->quality = q; res->downscale = scale; res->width = w; res->height = h;
+			}
+			else free(tmp.data);
+			
+			if(fits && q == hi) break;
+			if(fits) lo = q + 1; else hi = q - 1;
+			q = (lo + hi + 1) / 2;
+		}
+		if(budget == 0 || (long)best.size <= budget) break;
+		
+		// nothing fits, try again at half the resolution
+		if(scale >= prof->max_downscale || -1 == downscale_half(src, w, h, comps, &next, &nw, &nh)) break;
+		free(cur.data);
+		cur = next;
+		src = cur.data; w = nw; h = nh;
+	}
+	
+	// progressive is about as big as baseline, one more encode that only pays when smaller
+	if(progressive_full && budget > 0 && res->width == w && res->height == h && 0 == encode_jpeg(src, w, h, comps, res->quality, 0, 1, &tmp)) {
+		if(tmp.size < best.size) {
+			free(best.data);
+			best = tmp;
+		}
+		else free(tmp.data);
+	}
+	
+	free(cur.data);
+	*jpg = best;
+	
+	double rate = (link_rate > 0) ? link_rate.load() : prof->link_rate;
+	res->seconds = (rate > 0) ? jpg->size / rate : 0;
+	if(budget && (long)jpg->size > budget)
+		cerr << "Profile " << prof->name << ": " << jpg->size << " bytes, over the budget of " << budget << endl;
+	return 0;
+}
+
+// Decodes jpg at 1/2 .. 1/8 scale (libjpeg scales in the DCT domain, so this is cheap),
+// halves it down to preview_max_side and encodes that as a small baseline JPEG.
+int make_preview(const mem_buf *jpg, mem_buf *prev)
+{
+	struct jpeg_decompress_struct dinfo;
+	jpeg_err       err;
+	mem_buf        pix = {NULL, 0}, half;
+	int            w, h, comps;
+	
+	dinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_err_exit;
+	err.buf.data = NULL;
+	if(setjmp(err.jump)) {
+		jpeg_destroy_decompress(&dinfo);
+		free(err.buf.data);
+		return -1;
+	}
+	
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, jpg->data, jpg->size);
+	jpeg_read_header(&dinfo, TRUE);
+	
+	unsigned int side = max(dinfo.image_width, dinfo.image_height);
+	dinfo.scale_num   = 1;
+	dinfo.scale_denom = 1;
+	while(dinfo.scale_denom < 8 && side / (dinfo.scale_denom * 2) >= (unsigned int)preview_max_side)
+		dinfo.scale_denom *= 2;
+	
+	jpeg_start_decompress(&dinfo);
+	w = dinfo.output_width;
+	h = dinfo.output_height;
+	comps = dinfo.output_components;
+	pix.size = (size_t)w * h * comps;
+	pix.data = err.buf.data = (unsigned char *)malloc(pix.size);
+	if(pix.data == NULL) {
+		jpeg_destroy_decompress(&dinfo);
+		return -1;
+	}
+	while(dinfo.output_scanline < dinfo.output_height) {
+		JSAMPROW row = pix.data + (size_t)dinfo.output_scanline * w * comps;
+		jpeg_read_scanlines(&dinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+	
+	while(max(w, h) > preview_max_side && 0 == downscale_half(pix.data, w, h, comps, &half, &w, &h)) {
+		free(pix.data);
+		pix = half;
+	}
+	
+	int ret = encode_jpeg(pix.data, w, h, comps, preview_quality, 0, 0, prev);
+	free(pix.data);
+	return ret;
+}
+
+// Adds a completed study to the next notification, once per study
+void notify_study(const string &uid, const string &text)
+{
+	if(sms_window < 0) return;
+	
+	lock_guard<mutex> lock(notices.mtx);
+	if(notices.studies.empty()) notices.first = time(NULL);
+	if(0 == notices.files[uid]++) {
+		notices.studies.push_back(uid);
+		notices.text[uid] = text;
+	}
+}
+
+// The batch as one message when it is due: sms_window seconds after its first study,
+// and the link idle (when 1) or the batch waiting sms_max_delay already. when 2 takes
+// anything, at shutdown. The studies that don't fit in sms_max_parts are counted in a
+// "+N more" line. They all stay in the batch, and no other modem takes it, until
+// notices_sent() says how the send went.
+bool take_notices(string *msg, int when)
+{
+	lock_guard<mutex> lock(notices.mtx);
+	if(notices.studies.empty() || notices.sending) return false;
+	
+	time_t now = time(NULL);
+	long age = now - notices.first;
+	if(when != 2 && now < notices.retry) return false;
+	if(when == 0 && age < sms_max_delay) return false;
+	if(when == 1 && age < sms_window) return false;
+	
+	size_t n = notices.studies.size(), shown;
+	*msg = to_string(n) + " studies uploaded";
+	for(shown = 0; shown < n; shown++) {
+		const string &uid = notices.studies[shown];
+		string line = "\n" + notices.text[uid];
+		if(notices.files[uid] > 1) line += " (" + to_string(notices.files[uid]) + ")";
+		// room for the "+N more" line unless this is the last one
+		size_t more = (shown + 1 < n) ? 12 : 0;
+		if(msg->size() + line.size() + more > (size_t)sms_max_parts * 153) break;
+		*msg += line;
+	}
+	if(shown < n) *msg += "\n+" + to_string(n - shown) + " more";
+	notices.sending = n;
+	return true;
+}
+
+// How the message of take_notices() went, ret of send_sms(). Sent, its studies leave the
+// batch and the ones completed meanwhile start a new window. Not sent, all of it is tried
+// again in link_retry_min seconds.
+void notices_sent(int ret)
+{
+	lock_guard<mutex> lock(notices.mtx);
+	if(ret == 0) {
+		for(size_t i = 0; i < notices.sending; i++) {
+			notices.text.erase(notices.studies[i]);
+			notices.files.erase(notices.studies[i]);
+		}
+		notices.studies.erase(notices.studies.begin(), notices.studies.begin() + notices.sending);
+		notices.first = time(NULL);
+	}
+	else {
+		cout << "Notification of " << notices.sending << " studies not sent, retrying in " << link_retry_min << " s" << endl;
+		notices.retry = time(NULL) + link_retry_min;
+	}
+	notices.sending = 0;
+}
+
+// Text mode SMS to sms_number. Up to 160 characters go in one AT+CMGS, longer text in
+// concatenated parts of 153 with AT+CMGSEX, the phone shows them as one message.
+int send_sms(const char *text)
+{
+	string msg;
+	
+	// GSM 7 bit alphabet: DICOM name separators and anything outside ASCII are replaced
+	for(const char *p = text; *p; p++) {
+		char c = *p;
+		if(c == '^') c = ' ';
+		else if(c != '\n' && (c < ' ' || c > '~' || c == '[' || c == ']' || c == '{' || c == '}' || c == '\\' || c == '|' || c == '~')) c = '?';
+		msg += c;
+	}
+	
+	int parts = (msg.size() <= 160) ? 1 : (msg.size() + 152) / 153;
+	if(parts > sms_max_parts) {
+		parts = sms_max_parts;
+		msg.resize(parts * 153 - 12);
+		msg += "\n.. and more";
+	}
+	
+	if(-1 == run_script(sms_setup_script, sizeof(sms_setup_script) / sizeof(sms_setup_script[0]))) return -1;
+	tx_enable = 1;
+	
+	// ties the parts together, a different one every message and every run
+	static atomic<unsigned> next_ref(time(NULL) ^ getpid());
+	int ref = next_ref++ & 0xFF;
+	int v[3];
+	char cmgs[80];
+	for(int i = 0; i < parts; i++) {
+		//AT+CMGS="<number>", or AT+CMGSEX for a part, -> "> "
+		at_step step = (parts == 1) ?
+			at_step_fmt(cmgs, sizeof(cmgs), "> ", at_cmd_timeout, true, "AT+CMGS=\"%s\"\r", sms_number) :
+			at_step_fmt(cmgs, sizeof(cmgs), "> ", at_cmd_timeout, true, "AT+CMGSEX=\"%s\",%d,%d,%d\r", sms_number, ref, i + 1, parts);
+		if(-1 == run_script(&step, 1)) return -1;
+		
+		// the text and Ctrl-Z -> +CMGS: <reference> once the network took it
+		string part = (parts == 1) ? msg : msg.substr(i * 153, 153);
+		cout << part << endl;
+		part += at_A[0];
+		if(-1 == uart_write_tmp((const unsigned char *)part.data(), part.size())) {
+			perror("message Write Error  !!!! ");
+			return -1;
+		}
+		if(uart_read_urc(TOK_CMGS, v, at_cmd_timeout) < 1) {
+			cout << "SMS part " << i + 1 << " not sent" << endl;
+			return -1;
+		}
+	}
+	
+    cout<<"message sent"<<endl;
+    link_used = time(NULL);
+    return 0;
+    
+}
+
+// Serial write: the command in uart_str goes out through the engine, the reply comes to
+// the byte readers
+int uart_write()
+{
+	if(-1 == at_submit(at_eng, uart_str, at_cmd_timeout * 1000, NULL, false)) return -1;
+    if(read_ok) cout<<"Bytes Written "<<strlen(uart_str)<<endl;
+    return 0;
+}
+
+// Raw data straight from the caller's buffer, all of it
+int uart_write_tmp(const unsigned char *buf, size_t size)
+{
+	size_t done = 0;
+	
+	while(done < size) {
+		ssize_t n = write(uart0_filestream, buf + done, size - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0)  return -1;
+		done += n;
+	}
+	trace_bytes(uart_trace, TRACE_TX, buf, done);
+    if(read_ok) cout<<"Bytes Written "<<done<<endl;
+    return 0;
+}
+
+static long long at_now_ms()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+// Input for the byte readers, the oldest byte goes when nobody reads them. The reply of a
+// quiet command is only for its result.
+static void at_pass_on(at_engine *e, const char *p, size_t n)
+{
+	if(!n || (e->busy && e->cmds.front().quiet)) return;
+	for(size_t i = 0; i < n; i++) {
+		if(e->out.tail - e->out.head == uart_ring_size) {
+			e->out.head++;
+			e->overrun++;
+		}
+		e->out.buf[e->out.tail++ % uart_ring_size] = p[i];
+	}
+	e->readable.notify_all();
+}
+
+// The command that is out is done; its callback runs once the lock is let go
+static void at_finish(at_engine *e, int status, vector<function<void()> > *calls)
+{
+	at_request &c = e->cmds.front();
+	
+	e->res.status = status;
+	if(c.done) calls->push_back(bind(c.done, e->res));
+	e->cmds.pop_front();
+	e->res.lines.clear();
+	e->busy = false;
+}
+
+// Puts the next command on the wire, unless a data transfer of another thread has the port
+static void at_next(at_engine *e, vector<function<void()> > *calls)
+{
+	while(!e->busy && !e->cmds.empty() && !(e->hold && e->cmds.front().from != e->holder)) {
+		const string &w = e->cmds.front().cmd;
+		size_t done = 0;
+	
+		while(done < w.size()) {
+			ssize_t n = write(e->fd, w.data() + done, w.size() - done);
+			if(n < 0 && errno == EINTR) continue;
+			if(n < 0) break;
+			done += n;
+		}
+		trace_bytes(e->trace, TRACE_TX, w.data(), done);
+		e->busy = true;
+		e->deadline = at_now_ms() + e->cmds.front().ms;
+		if(done < w.size()) at_finish(e, AT_CLOSED, calls);
+	}
+}
+
+// A command went out from another thread, the engine has a deadline to wait for now
+static void at_wake(at_engine *e)
+{
+	uint64_t one = 1;
+	if(write(e->wake, &one, sizeof(one)) < 0) perror("eventfd error  !!!! ");
+}
+
+static bool at_final(const string &l, int *status)
+{
+	if(l == "OK" || l == "SHUT OK") *status = AT_OK;
+	else if(l == "ERROR" || 0 == l.compare(0, 10, "+CME ERROR") || 0 == l.compare(0, 10, "+CMS ERROR")) *status = AT_ERROR;
+	else return false;
+	return true;
+}
+
+// Could the line received so far still turn out to be a URC
+static bool at_maybe_urc(const at_engine *e)
+{
+	for(size_t i = 0; i < e->urcs.size(); i++) {
+		size_t n = min(e->line.size(), e->urcs[i].first.size());
+		if(0 == e->line.compare(0, n, e->urcs[i].first, 0, n)) return true;
+	}
+	return false;
+}
+
+// Splits the input in lines. A URC goes to its handler and nowhere else. Anything else is
+// passed on as it comes, as soon as it can't be a URC (a prompt has no line end), and the
+// lines of it are the reply of the command that is out.
+static void at_input(at_engine *e, const char *p, size_t n, vector<function<void()> > *calls)
+{
+	for(size_t i = 0; i < n; i++) {
+		char c = p[i];
+	
+		if(c != '\r' && c != '\n') {
+			if(e->line.size() < at_line_max) e->line += c;
+			else if(e->released == e->line.size()) at_pass_on(e, &c, 1);
+			if(e->released < e->line.size() && !at_maybe_urc(e)) {
+				at_pass_on(e, e->line.data() + e->released, e->line.size() - e->released);
+				e->released = e->line.size();
+			}
+			// the prompt of AT+CMGS, nothing comes after it until the text is sent
+			if(e->line == "> " && e->busy && !e->cmds.empty() && e->cmds.front().one_line) {
+				e->res.lines.push_back(e->line);
+				at_finish(e, AT_OK, calls);
+				e->line.clear();
+				e->released = 0;
+			}
+			continue;
+		}
+	
+		if(!e->line.empty()) {
+			size_t u = 0;
+			while(u < e->urcs.size() && 0 != e->line.compare(0, e->urcs[u].first.size(), e->urcs[u].first)) u++;
+	
+			if(u < e->urcs.size() && e->released == 0) calls->push_back(bind(e->urcs[u].second, e->line));
+			else {
+				at_pass_on(e, e->line.data() + e->released, e->line.size() - e->released);
+				// with echo on the command comes back first. Nothing out: a late reply or
+				// data of a transfer (+FTPPUT: 1,1,.., CONNECT), the byte readers have it.
+				if(e->busy && !e->cmds.empty()) {
+					const at_request &c = e->cmds.front();
+					int status;
+					if(!(e->line.size() + 1 == c.cmd.size() && 0 == c.cmd.compare(0, e->line.size(), e->line))) {
+						e->res.lines.push_back(e->line);
+						if(at_final(e->line, &status)) at_finish(e, status, calls);
+						else if(c.one_line) at_finish(e, AT_OK, calls);
+					}
+				}
+			}
+			e->line.clear();
+			e->released = 0;
+		}
+		at_pass_on(e, &c, 1);
+	}
+}
+
+// The engine's thread: reads whatever the modem sends, and times out the command that is out
+static void at_loop(at_engine *e)
+{
+	char buf[512];
+	vector<function<void()> > calls;
+	
+	for(;;) {
+		struct epoll_event ev[2];
+		int ms = -1;
+		{
+			lock_guard<mutex> lock(e->mtx);
+			if(e->stop) break;
+			if(e->busy) ms = max(0LL, e->deadline - at_now_ms());
+		}
+		int n = epoll_wait(e->ep, ev, 2, ms);
+		if(n < 0 && errno != EINTR) {
+			perror("epoll error  !!!! ");
+			break;
+		}
+	
+		unique_lock<mutex> lock(e->mtx);
+		for(int i = 0; i < n; i++) {
+			if(ev[i].data.fd == e->wake) {
+				uint64_t v;
+				if(read(e->wake, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd error  !!!! ");
+				continue;
+			}
+			ssize_t got = read(e->fd, buf, sizeof(buf));
+			if(got > 0) {
+				trace_bytes(e->trace, TRACE_RX, buf, got);
+				at_input(e, buf, got, &calls);
+			}
+			else if(got == 0 || (errno != EINTR && errno != EAGAIN)) {
+				// unplugged: readers get -1 and commands AT_CLOSED from now on
+				cout << "Modem port closed" << endl;
+				epoll_ctl(e->ep, EPOLL_CTL_DEL, e->fd, NULL);
+				e->dead = true;
+				e->readable.notify_all();
+			}
+		}
+		if(e->busy && at_now_ms() >= e->deadline) at_finish(e, AT_TIMEOUT, &calls);
+		if(e->dead) while(!e->cmds.empty()) at_finish(e, AT_CLOSED, &calls);
+		at_next(e, &calls);
+		lock.unlock();
+	
+		for(size_t i = 0; i < calls.size(); i++) calls[i]();
+		calls.clear();
+	}
+	
+	unique_lock<mutex> lock(e->mtx);
+	e->dead = true;
+	while(!e->cmds.empty()) at_finish(e, AT_CLOSED, &calls);
+	e->readable.notify_all();
+	lock.unlock();
+	for(size_t i = 0; i < calls.size(); i++) calls[i]();
+}
+
+// Starts the engine on an open port, with handlers for the URCs telling the modem dropped
+// session state by itself. NULL if epoll isn't available.
+at_engine *at_start(int fd, FILE *trace)
+{
+	at_engine *e = new at_engine();
+	struct epoll_event ev;
+	
+	e->fd = fd;
+	e->trace = trace;
+	e->busy = e->dead = e->stop = false;
+	e->hold = 0;
+	e->released = 0;
+	e->out.head = e->out.tail = 0;
+	e->overrun = 0;
+	e->bearer_lost = e->ip_lost = e->restarted = 0;
+	e->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	e->ep = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if(e->wake == -1 || e->ep == -1 || -1 == epoll_ctl(e->ep, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll error  !!!! ");
+		if(e->wake != -1) close(e->wake);
+		if(e->ep != -1) close(e->ep);
+		delete e;
+		return NULL;
+	}
+	ev.data.fd = e->wake;
+	epoll_ctl(e->ep, EPOLL_CTL_ADD, e->wake, &ev);
+	
+	at_on_urc(e, "+SAPBR 1: DEACT", [e](const string &l) { cout << l << endl; e->bearer_lost = 1; });
+	at_on_urc(e, "+PDP: DEACT", [e](const string &l) { cout << l << endl; e->bearer_lost = 1; e->ip_lost = 1; });
+	at_on_urc(e, "RDY", [e](const string &l) { cout << l << endl; e->restarted = 1; });
+	at_on_urc(e, "NORMAL POWER DOWN", [e](const string &l) { cout << l << endl; e->restarted = 1; });
+	at_on_urc(e, "UNDER-VOLTAGE POWER DOWN", [e](const string &l) { cout << l << endl; e->restarted = 1; });
+	at_on_urc(e, "+CMTI:", [](const string &l) { cout << "SMS received " << l << endl; });
+	
+	e->th = thread(at_loop, e);
+	return e;
+}
+
+void at_stop(at_engine *e)
+{
+	{
+		lock_guard<mutex> lock(e->mtx);
+		e->stop = true;
+	}
+	at_wake(e);
+	e->th.join();
+	close(e->wake);
+	close(e->ep);
+	delete e;
+}
+
+// Queues the frame cmd (a CR is added when it has none) with a deadline of ms from when it
+// goes out; done gets the result on the engine's thread. one_line for a command answered
+// by a single line and no result code (AT+CIFSR). A command of the byte readers (not quiet)
+// replaces the one of theirs still out: its caller has moved on, whatever came of it.
+// -1 once the port is gone.
+int at_submit(at_engine *e, const string &cmd, int ms, function<void(const at_result &)> done, bool quiet, bool one_line)
+{
+	vector<function<void()> > calls;
+	at_request c;
+	
+	if(!e) return -1;
+	c.cmd = cmd;
+	if(c.cmd.empty() || c.cmd[c.cmd.size() - 1] != '\r') c.cmd += '\r';
+	c.ms = ms;
+	c.quiet = quiet;
+	c.one_line = one_line;
+	c.from = this_thread::get_id();
+	c.done = done;
+	
+	unique_lock<mutex> lock(e->mtx);
+	if(e->dead || e->stop) return -1;
+	if(!quiet && e->busy && !e->cmds.front().quiet && e->cmds.front().from == c.from) at_finish(e, AT_TIMEOUT, &calls);
+	e->cmds.push_back(c);
+	at_next(e, &calls);
+	lock.unlock();
+	
+	at_wake(e);
+	for(size_t i = 0; i < calls.size(); i++) calls[i]();
+	return 0;
+}
+
+// The same, with the result as a future
+future<at_result> at_command(at_engine *e, const string &cmd, int ms, bool one_line)
+{
+	shared_ptr<promise<at_result> > p = make_shared<promise<at_result> >();
+	future<at_result> f = p->get_future();
+	
+	if(-1 == at_submit(e, cmd, ms, [p](const at_result &r) { p->set_value(r); }, true, one_line)) {
+		at_result r;
+		r.status = AT_CLOSED;
+		p->set_value(r);
+	}
+	return f;
+}
+
+// Lines starting with prefix go to handler, on the engine's thread
+void at_on_urc(at_engine *e, const char *prefix, function<void(const string &)> handler)
+{
+	lock_guard<mutex> lock(e->mtx);
+	e->urcs.push_back(make_pair(string(prefix), handler));
+}
+
+// Data written straight to the port (FTP data, transparent TCP) must not get commands of
+// other threads in between: while held, only the holder's commands go out
+void at_hold(at_engine *e, int on)
+{
+	vector<function<void()> > calls;
 	
-	}
+	if(!e) return;
+	unique_lock<mutex> lock(e->mtx);
+	e->hold = on;
+	e->holder = this_thread::get_id();
+	if(!on) at_next(e, &calls);
+	lock.unlock();
 	
-	tx_enable = 0;
-	if(-1 == uart_read_MSG()) perror("Serial Read Error  !!!! ");
+	at_wake(e);
+	for(size_t i = 0; i < calls.size(); i++) calls[i]();
+}
+
+// Trace file of the modem on dev, <trace_prefix>.<device name>. Appended to, so a modem
+// that is reopened after a failure keeps the lead-up to it. NULL when not tracing or it
+// can't be created.
+FILE *trace_open(const char *dev)
+{
+	const char *base = strrchr(dev, '/');
 	
+	if(!trace_prefix) return NULL;
+	string path = string(trace_prefix) + "." + (base ? base + 1 : dev);
+	FILE *f = fopen(path.c_str(), "ab");
+	if(f) fseek(f, 0, SEEK_END);
+	if(!f || (0 == ftell(f) && 1 != fwrite(trace_magic, sizeof(trace_magic) - 1, 1, f))) {
+		perror("trace open error  !!!! ");
+		if(f) fclose(f);
+		return NULL;
+	}
+	cout << "Tracing " << dev << " to " << path << endl;
+	return f;
+}
+
+// One read or write of the port into the trace. Flushed right away: the trace is for the
+// problems that end with a crash or a power cut.
+void trace_bytes(FILE *f, int dir, const void *p, size_t n)
+{
+	const char *b = (const char *)p;
 	
-	if(tx_enable) {
+	if(!f || !n) return;
+	flockfile(f);		// the engine's and the modem's thread both write
+	while(n) {
+		trace_rec r;
+		r.ms = at_now_ms();
+		r.len = min(n, (size_t)UINT16_MAX);
+		r.dir = dir;
+		r.spare = 0;
+		fwrite(&r, sizeof(r), 1, f);
+		fwrite(b, r.len, 1, f);
+		b += r.len;
+		n -= r.len;
+	}
+	fflush(f);
+	funlockfile(f);
+}
+
+// Runs an AT script through the engine, a round trip per step. 0 when every step got its
+// reply, -1 at the first that didn't (ERROR, or nothing within its timeout).
+int run_script(const at_step *steps, size_t n)
+{
+	for(size_t i = 0; i < n; i++) {
+		string frame(steps[i].frame, steps[i].len);
+		cout << frame << endl;
+		if(frame.empty()) return -1;
 		
-		strcpy(uart_str,patientName.data());
-		cout << uart_str << endl;
-		strcat(uart_str,at_A);
-		if(-1 == uart_write())	perror("message Write Error  !!!! ");
-	
+		at_result r = at_command(at_eng, frame, steps[i].secs * 1000, steps[i].one_line).get();
+		bool got = false;
+		for(size_t l = 0; l < r.lines.size() && !got; l++) got = (NULL != strstr(r.lines[l].c_str(), steps[i].expect));
+		if(r.status != AT_OK || !got) {
+			cout << "No " << steps[i].expect << " for " << frame << endl;
+			return -1;
+		}
+		cout << steps[i].expect << endl;
 	}
-    
-    tx_enable = 0;
-    if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-	
-    cout<<"message sent"<<endl;
-    
+	return 0;
 }
 
-// Serial write
-int uart_write()
+// A step of a script made at run time, the frame printed into buf: buf has to last as long
+// as the script. A frame that doesn't fit is left empty, run_script() fails on it.
+at_step at_step_fmt(char *buf, size_t size, const char *expect, int secs, bool one_line, const char *fmt, ...)
 {
-    int n = write(uart0_filestream, uart_str, strlen(uart_str));
-    if (n < 0)  return -1;
-    if(read_ok) cout<<"Bytes Written "<<n<<endl;
+	va_list ap;
+	
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	if(n < 0 || (size_t)n >= size) {
+		cout << "AT command too long: " << buf << endl;
+		n = 0;
+	}
+	
+	at_step s = { buf, (size_t)n, expect, secs, one_line };
+	return s;
 }
 
-int uart_write_tmp(int size)
+// Session state the modem dropped by itself, as its URCs told the engine
+static void apply_urcs()
 {
-	int n = write(uart0_filestream, uart_str, size);
-    if (n < 0)  return -1;
-    if(read_ok) cout<<"Bytes Written "<<n<<endl;
+	if(!at_eng) return;
+	if(at_eng->restarted.exchange(0)) {
+		cout << "Modem restarted, starting over" << endl;
+		bearer_up = ip_up = ftp_configured = 0;
+		ftp_putopt = -1;
+	}
+	if(at_eng->bearer_lost.exchange(0)) bearer_up = ftp_configured = 0;
+	if(at_eng->ip_lost.exchange(0)) ip_up = 0;
 }
 
-// Serial read for OK response
-int uart_read_OK()
+// Builds the automaton of the reply tokens: a trie of the tokens, then every missing
+// transition filled in from the failure link, so matching is one table lookup per byte
+// whatever the tokens share.
+static reply_matcher build_reply_matcher()
 {
-	int  n=-1;
-	char tmp=0,prev=0;
+	reply_matcher m;
+	vector<int> fail(1, 0);
 	
-	//if(read_ok) cout<<"in read OK"<<endl;
+	m.next.push_back(vector<int16_t>(256, -1));
+	m.out.push_back(0);
+	for(int t = 0; t < TOK_COUNT; t++) {
+		int st = 0;
+		for(const char *p = reply_tokens[t]; *p; p++) {
+			unsigned char c = *p;
+			if(m.next[st][c] == -1) {
+				m.next[st][c] = m.next.size();
+				m.next.push_back(vector<int16_t>(256, -1));
+				m.out.push_back(0);
+				fail.push_back(0);
+			}
+			st = m.next[st][c];
+		}
+		m.out[st] |= 1u << t;
+	}
 	
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  return -1;
-		if(read_ok)	printf("%x\n",tmp);
-		if(tmp == 'K' && prev == 'O')	 break;
-		prev = tmp;
+	// breadth first, a state's failure link is always done before the state
+	deque<int> bfs;
+	for(int c = 0; c < 256; c++) {
+		if(m.next[0][c] == -1) m.next[0][c] = 0;
+		else bfs.push_back(m.next[0][c]);
 	}
-	cout<<"OK"<<endl;	
-		
-	tx_enable = 1;
-	return 0;
-				
+	while(!bfs.empty()) {
+		int st = bfs.front();
+		bfs.pop_front();
+		m.out[st] |= m.out[fail[st]];
+		for(int c = 0; c < 256; c++) {
+			int to = m.next[st][c];
+			if(to == -1) m.next[st][c] = m.next[fail[st]][c];
+			else {
+				fail[to] = m.next[fail[st]][c];
+				bfs.push_back(to);
+			}
+		}
+	}
+	return m;
 }
 
-int uart_read_MSG()
-{	
-	int  n=-1;
-	char tmp=0;
-		
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  return -1;
-		//printf("%x\n",tmp);
-		if(tmp == '>')	 break;
-	}
+// Next byte of the modem's input the engine passed on, -1 once the port is gone or after
+// ms (-1 for no limit) without data
+static int uart_getc(int ms)
+{
+	if(!at_eng) return -1;
 	
-	cout<<">"<<endl;
-	tx_enable = 1;
-	return 0;
+	unique_lock<mutex> lock(at_eng->mtx);
+	uart_ring &in = at_eng->out;
+	auto ready = [&in] { return in.head != in.tail || at_eng->dead; };
+	if(ms < 0) at_eng->readable.wait(lock, ready);
+	else if(!at_eng->readable.wait_for(lock, chrono::milliseconds(ms), ready)) return -1;
+	if(at_eng->overrun) {
+		cout << at_eng->overrun << " bytes of modem input dropped, nobody read them in time" << endl;
+		at_eng->overrun = 0;
+	}
+	if(in.head == in.tail) return -1;
 	
+	unsigned char c = in.buf[in.head++ % uart_ring_size];
+	if(read_ok)	printf("%x\n",c);
+	return c;
 }
 
-int uart_read_FTPPUT(const char *ptr_l)
+// Runs the reply automaton until one of the tokens in want has come, returns its id;
+// -1 on a read error or ms of silence
+static int uart_read_token(unsigned want, int ms)
 {
-	int  n=-1,i=0,j=0;
-	char tmp=0,prev=0;
-	char resp_buf[256];
-		
-	for(i=0;i<256;i++) resp_buf[i]=0;
+	static const reply_matcher m = build_reply_matcher();
+	int st = 0, c;
 	
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  return -1;
-		if(read_ok)	printf("%x\n",tmp);
-		resp_buf[j++] = tmp;
-		if(NULL != strstr(resp_buf,ptr_l)) break;
+	while(-1 != (c = uart_getc(ms))) {
+		st = m.next[st][c];
+		if(m.out[st] & want) return __builtin_ctz(m.out[st] & want);
 	}
+	return -1;
+}
+
+// Serial read for OK response, -1 on ERROR or at_cmd_timeout of silence
+int uart_read_OK()
+{
+	int tok = uart_read_token(1u << TOK_OK | 1u << TOK_ERROR, at_cmd_timeout * 1000);
 	
-	cout<<ptr_l<<endl;
 	tx_enable = 1;
+	if(tok != TOK_OK) return -1;
+	cout<<"OK"<<endl;	
 	return 0;
+				
 }
 
+// 0 on OK, 6 on ERROR
 int uart_read_gen()
 {
-	int  n=-1,i=0,j=0;
-	char tmp=0,prev=0;
-	char resp_buf[256];
-		
-	for(i=0;i<256;i++) resp_buf[i]=0;
-	
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  return -1;
-		//printf("%x\n",tmp);
-		resp_buf[j++] = tmp;
-		//cout<<resp_buf<<endl;
-		if(NULL != strstr(resp_buf,"ERROR")) {/*cout<<"error"<<endl;*/tx_enable = 1; return 6;}
-		if(NULL != strstr(resp_buf,"OK")) {/*cout<<"success"<<endl;*/ break;}
-		
-	}
+	int tok = uart_read_token(1u << TOK_OK | 1u << TOK_ERROR, at_cmd_timeout * 1000);
 	
-	cout<<"OK"<<endl;
+	if(tok == -1) return -1;
 	tx_enable = 1;
+	if(tok == TOK_ERROR) return 6;
+	cout<<"OK"<<endl;
 	return 0;
 	
 }
 
 int uart_read_temp()
 {
-	int  n=-1,i=0,j=0;
-	char tmp=0,prev=0;
-	char resp_buf[256];
-		
-	for(i=0;i<256;i++) resp_buf[i]=0;
+	int c;
 	
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  return -1;
-		printf("%x\n",tmp);
-		//resp_buf[j++] = tmp;
-		//cout<<resp_buf<<endl;
-	}
+	while(-1 != (c = uart_getc(at_cmd_timeout * 1000))) printf("%x\n",c);
 	
 	tx_enable = 1;
 	return 0;
 	
 }
 
-void upload_file()
+// Waits for the URC tok and parses up to three comma separated numbers after it, up to
+// the line end, into v. Returns how many were parsed, -1 on ERROR, a read error or secs
+// (ftp_reply_timeout when -1) seconds of silence.
+int uart_read_urc(int tok, int *v, int secs)
 {
-	//AT
-	if(tx_enable) {
-		strcpy(uart_str,"AT");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
-	}
+	char rest[64];
+	size_t len = 0;
+	int c;
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-	
-	//at+sapbr=3,1,"Contype","GPRS"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+SAPBR=3,1,\"Contype\",\"GPRS\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	if(secs == -1) secs = ftp_reply_timeout;
+	if(tok != uart_read_token(1u << tok | 1u << TOK_ERROR, secs * 1000)) return -1;
+	while((c = uart_getc(secs * 1000)) != '\r' && c != '\n') {
+		if(c == -1) return -1;
+		if(len < sizeof(rest) - 1) rest[len++] = c;
 	}
+	rest[len] = 0;
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-	
-	//at+sapbr=3,1,"APN","internet"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+SAPBR=3,1,\"APN\",\"internet\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
-	}
+	int n = sscanf(rest, "%d,%d,%d", &v[0], &v[1], &v[2]);
+	cout << reply_tokens[tok] << rest << endl;
+	tx_enable = 1;
+	return (n < 0) ? 0 : n;
+}
+
+// Waits for the reply tok, 0 when it came, -1 on ERROR, FAIL, a read error or secs seconds
+// of silence. CONNECT FAIL is no CONNECT: that token has the line end in it.
+int uart_read_reply(int tok, int secs)
+{
+	int got = uart_read_token(1u << tok | 1u << TOK_ERROR | 1u << TOK_FAIL, secs * 1000);
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	if(got == -1) return -1;
+	cout << string(reply_tokens[got], strcspn(reply_tokens[got], "\r")) << endl;
+	tx_enable = 1;
+	return (got == tok) ? 0 : -1;
+}
+
+// Uploads jpg to the FTP server as remote_name. When the session drops mid transfer the
+// bearer and session are opened again and the file is appended to from what the server
+// already has, instead of starting over. -1 if the bearer could not be opened or the
+// upload still fails after ftp_resume_max resumes.
+int upload_file(const char *remote_name, const mem_buf *jpg)
+{
+	size_t acked = 0;		// bytes the modem took, where a resume picks up
+	size_t offset = 0;
+	int attempt;
+	int v[3];
+	struct timespec t_start;
 	
-	//at+sapbr=1,1
-	int sapbr_cnt = 5,ret;
-	while(sapbr_cnt) {
-		if(tx_enable) {
-			strcpy(uart_str,"AT+SAPBR=1,1");
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for(attempt = 0; attempt <= ftp_resume_max; attempt++) {
+		if(attempt) {
+			// start over from a closed bearer, the old one may be half up
+			bearer_up = 0;
+			tx_enable = 1;
+			strcpy(uart_str,"AT+SAPBR=0,1");
 			strcat(uart_str,at_D);
 			cout << uart_str << endl;
 			if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+			tx_enable = 0;
+			if(-1 == uart_read_gen()) perror("Serial Read Error  !!!! ");
 		}
-		tx_enable = 0;
-		ret = uart_read_gen();
-		if(-1 == ret) perror("Serial Read Error  !!!! ");
-		else if(0 == ret) {break;}
-		else if(6 == ret && 1 == sapbr_cnt) {cout << "SAPBR setting unsuccessfull" << endl; return;}
-		cout<<"Retrying..."<< sapbr_cnt <<endl;
-		sapbr_cnt--;
-	}
+		if(-1 == open_bearer()) return -1;
 		
-	//at+sapbr=2,1
-	if(tx_enable) {
-		strcpy(uart_str,"AT+SAPBR=2,1");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+		if(attempt) {
+			// the modem buffers, the server may have less than it acknowledged
+			long remote = ftp_remote_size(remote_name);
+			offset = (remote >= 0 && (size_t)remote <= acked) ? remote : 0;
+			cout << "Resuming " << remote_name << " at byte " << offset << " of " << jpg->size << endl;
+			acked = offset;
+		}
+		
+		if(0 == ftp_open(remote_name, offset) && 0 == ftp_send(jpg, &acked)) break;
+		cout << "FTP session lost after " << acked << " bytes" << endl;
+		ftp_chunk = max(ftp_chunk / 2, ftp_chunk_min);		// less to lose next time
+	}
+	if(attempt > ftp_resume_max) {
+		cout << "Upload of " << remote_name << " failed" << endl;
+		return -1;
 	}
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-		
-	//at+ftpcid=1
+	//total bytes written into the file
+	cout << "total bytes written : " << jpg->size << endl;
+	
+	if(attempt == 0) update_link_rate(jpg->size, &t_start);
+
+	//at+ftpput=2,0
 	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPCID=1");
+		strcpy(uart_str,"AT+FTPPUT=2,0");
 		strcat(uart_str,at_D);
 		cout << uart_str << endl;
 		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
 	}
-	
 	tx_enable = 0;
 	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-		
-	//AT+FTPSERV="www.kaimsofttech.com"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPSERV=\"www.kaimsofttech.com\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	//+FTPPUT: 1,0 once the server has the file, 1,<error> if it doesn't. The modem may
+	//still send the +FTPPUT: 1,1,<max> of the last chunk after this OK, that is no result.
+	tx_enable = 0;
+	int n;
+	do {
+		n = uart_read_urc(TOK_FTPPUT, v);
+	} while(n >= 2 && v[0] == 1 && v[1] == 1);
+	tx_enable = 1;
+	if(n < 2 || v[0] != 1 || v[1] != 0) {
+		cout << "Upload of " << remote_name << " not closed by the server" << endl;
+		return -1;
 	}
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	link_used = time(NULL);
+	cout<<"file uploaded successfully"<<endl;
+	return 0;
+			
+}
+
+// GPRS bearer, opened once and kept. An open bearer is only checked (AT+SAPBR=2,1) when
+// the link has been idle for bearer_check_idle seconds, a bearer that died in between
+// shows up as a failed FTPPUT and goes through the resume path. -1 if it could not be opened.
+int open_bearer()
+{
+	apply_urcs();
+	if(bearer_up && time(NULL) - link_used < bearer_check_idle) return 0;
 	
-	//AT+FTPUN="kaimsoft"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPUN=\"kaimsoft\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	if(bearer_up) {
+		//at+sapbr=2,1 -> +SAPBR: 1,<status>,"<ip>"
+		if(0 == run_script(bearer_check_script, sizeof(bearer_check_script) / sizeof(bearer_check_script[0]))) {
+			link_used = time(NULL);
+			return 0;
+		}
+		cout << "Bearer lost, attaching again" << endl;
+		tx_enable = 1;
+		bearer_up = 0;
+		ftp_configured = 0;
 	}
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	//at+sapbr=3,1,"Contype","GPRS";+sapbr=3,1,"APN","internet"
+	if(-1 == run_script(bearer_setup_script, sizeof(bearer_setup_script) / sizeof(bearer_setup_script[0]))) perror("Serial Read Error  !!!! ");
+	tx_enable = 1;
 	
-	//AT+FTPPW="1234Four!"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPW=\"1234Four!\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	//at+sapbr=1,1
+	int tries = bearer_open_tries;
+	while(-1 == run_script(bearer_open_script, sizeof(bearer_open_script) / sizeof(bearer_open_script[0]))) {
+		if(0 == --tries) {cout << "SAPBR setting unsuccessfull" << endl; return -1;}
+		cout<<"Retrying..."<< tries <<endl;
 	}
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-
-	//AT+FTPPUTNAME="one.jpeg"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPUTNAME=\"one9.jpeg\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	//at+sapbr=2,1
+	if(-1 == run_script(bearer_check_script, sizeof(bearer_check_script) / sizeof(bearer_check_script[0]))) {
+		cout << "Bearer not connected" << endl;
+		return -1;
 	}
+	
+	bearer_up = 1;
+	link_used = time(NULL);
+	return 0;
+}
 
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-
-	//at+ftpputpath="/www/prestashop/"
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPUTPATH=\"/www/prestashop/\"");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
-	}
+// FTP server, login and path, set once: the modem keeps them between sessions
+int ftp_login()
+{
+	tx_enable = 1;
+	if(-1 == run_script(ftp_setup_script, sizeof(ftp_setup_script) / sizeof(ftp_setup_script[0]))) return -1;
 	
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	ftp_configured = 1;
+	return 0;
+}
 
+// FTP session for remote_name: the put, appended to the server file when offset is not
+// 0. Only FTPPUTNAME and FTPPUT=1 go out when the modem is already set up.
+// -1 if the server didn't take it.
+int ftp_open(const char *remote_name, size_t offset)
+{
+	int v[3];
+	char put_name[160];
+	at_step steps[3];
+	size_t n_steps = 0;
+	
+	if(!ftp_configured) ftp_login();
+	
+	//AT+FTPPUTNAME="one9.jpeg"
+	steps[n_steps++] = at_step_fmt(put_name, sizeof(put_name), "OK", ftp_reply_timeout, false, "AT+FTPPUTNAME=\"%s\"\r", remote_name);
+	//at+ftpputopt="APPE" on a resume, "STOR" otherwise, when it changes
+	if(ftp_putopt != (offset != 0)) steps[n_steps++] = ftp_putopt_step[offset != 0];
 	//at+ftpput=1
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPUT=1");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	steps[n_steps++] = ftp_put_step;
 	
+	tx_enable = 1;
+	if(-1 == run_script(steps, n_steps)) {
+		ftp_putopt = -1;		// not known whether it went through
+		return -1;
 	}
+	ftp_putopt = (offset != 0);
 	
+	//+FTPPUT: 1,1,<max length>, anything else is an FTP error code
 	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
+	int n = uart_read_urc(TOK_FTPPUT, v);
+	if(n < 2 || v[0] != 1 || v[1] != 1) return -1;
+	if(n == 3 && v[2] > 0) {
+		ftp_max_len = min(v[2], ftp_chunk_cap);
+		ftp_chunk   = min(max(ftp_chunk, ftp_chunk_min), ftp_max_len);
+	}
+	return 0;
+}
+
+// Size of remote_name on the server, -1 if it can't be had
+long ftp_remote_size(const char *remote_name)
+{
+	int v[3];
+	char get_name[160];
+	
+	// FTPGETPATH is part of the setup
+	if(!ftp_configured) ftp_login();
+	
+	//AT+FTPGETNAME="one9.jpeg", AT+FTPSIZE -> +FTPSIZE: 1,0,<size>
+	at_step steps[] = {
+		at_step_fmt(get_name, sizeof(get_name), "OK", ftp_reply_timeout, false, "AT+FTPGETNAME=\"%s\"\r", remote_name),
+		ftp_size_step,
+	};
+	tx_enable = 1;
+	if(-1 == run_script(steps, sizeof(steps) / sizeof(steps[0]))) return -1;
+	
 	tx_enable = 0;
-	if(-1 == uart_read_FTPPUT(l1)) perror("Serial Read Error  !!!! ");
-	
-	//Read file and calculate size - send 1000 bytes at a time
-	FILE *fp = NULL;
-	int size,div,mod,cnt,total_bytes=0;
-	
-	if(NULL == (fp = fopen("one.jpeg","rb")))	perror(" file open error!!!! ");
-	fseek(fp,0,SEEK_END);
-	size = ftell(fp);
-	fseek(fp,0,SEEK_SET);
-	div = size/1000;
-	mod = size%1000;
-	fclose(fp);
-	
-	/*cout<< "div = " << div  << endl;	
-	cout<< "mod = " << mod  << endl;
-	cout<< "size = "<< size << endl;*/
-	
-	int c,fd;
-	fd = open("one.jpeg",O_RDONLY);
-	if(fd == -1) perror("file open error");
-		
-	//at+ftpput=2,1000
-	int temp_cnt = 0;
-	cnt = 1000;
-	while(div--) {
+	if(uart_read_urc(TOK_FTPSIZE, v) < 3 || v[1] != 0) {
+		tx_enable = 1;
+		return -1;
+	}
+	return v[2];
+}
+
+// Sends jpg from *acked on, ftp_chunk bytes at a time, written to the UART straight out
+// of the image buffer. *acked follows every chunk the modem took. -1 when the session is gone (FTP error code, ERROR or no reply)
+// or stuck (no room in the modem for ftp_full_max seconds).
+// The chunk grows toward the advertised maximum while chunks go through quickly, since
+// every chunk costs a round trip, and shrinks when they start to take long.
+int ftp_send(const mem_buf *jpg, size_t *acked)
+{
+	int v[3], c;
+	struct timespec t0, t1, full_since = {0, 0};
+	bool full = false;
+	
+	while(*acked < jpg->size) {
+		//at+ftpput=2,<len>
+		c = min((size_t)ftp_chunk, jpg->size - *acked);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		if(tx_enable) {
-			strcpy(uart_str,"AT+FTPPUT=2,1000");
+			snprintf(uart_str, sizeof(uart_str), "AT+FTPPUT=2,%d", c);
 			strcat(uart_str,at_D);
 			cout << uart_str << endl;
 			if(-1 == uart_write())	perror("AT Write Error  !!!! ");
 		}
 		tx_enable = 0;
-		/*if(temp_cnt>1) {
-			cout<<"Stuck Here "<<temp_cnt<<endl;
-			uart_read_temp();
-			return;
-		}*/
-		if(-1 == uart_read_FTPPUT(l2)) perror("Serial Read Error  !!!! ");
-		if(tx_enable) {
-			temp_cnt++;
-			c = read(fd,uart_str,cnt);
-			if(temp_cnt>1) cout<<"Bytes read "<<c<<endl;
-			if(c == -1) perror("Read System call failed");
-			if(-1 == uart_write_tmp(c))	perror("AT Write Error  !!!! ");
+		
+		//+FTPPUT:2,<len> is the go ahead, +FTPPUT:1,1,.. only says the modem is ready again
+		do {
+			if(uart_read_urc(TOK_FTPPUT, v) < 2) return -1;
+		} while(v[0] == 1 && v[1] == 1);
+		if(v[0] != 2) return -1;
+		if(v[1] == 0) {			// modem buffer full, ask again for a while
+			if(!full) full_since = t0;
+			full = true;
+			if((t0.tv_sec - full_since.tv_sec) + (t0.tv_nsec - full_since.tv_nsec) / 1e9 >= ftp_full_max) {
+				cout << "Modem buffer full for " << ftp_full_max << " s, session stuck" << endl;
+				return -1;
+			}
+			usleep(200000);
+			continue;
+		}
+		full = false;
+		
+		c = min(c, v[1]);
+		if(-1 == uart_write_tmp(jpg->data + *acked, c))	{
+			perror("AT Write Error  !!!! ");
+			return -1;
 		}
 		tx_enable = 0;
-		if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-		total_bytes += cnt;
-	} 
-	
-	//at+ftpput=2,mod
-	char mod_tmp[10];
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPUT=2,");
-		snprintf(mod_tmp, 10, "%d", mod); 
-		strcat(uart_str,mod_tmp);
-		strcat(uart_str,at_D`
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+		if(-1 == uart_read_OK()) return -1;
+		*acked += c;
+		
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double rtt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		if(c < ftp_chunk) ;		// short tail or grant, says nothing
+		else if(rtt < ftp_chunk_rtt) ftp_chunk = min(ftp_chunk + ftp_max_len / 4, ftp_max_len);
+		else ftp_chunk = max(ftp_chunk * 3 / 4, ftp_chunk_min);
 	}
+	return 0;
+}
 
-	tx_enable = 0;
-	if(-1 == uart_read_FTPPUT(l3)) perror("Serial Read Error  !!!! ");
+// Link rate for the encode profiles from an upload of bytes started at t_start, smoothed
+// over uploads
+void update_link_rate(size_t bytes, const struct timespec *t_start)
+{
+	struct timespec t_end;
 	
-	if(tx_enable) {
-		c = read(fd,uart_str,mod);
-		if(c == -1) perror("Read System call failed");
-		if(-1 == uart_write_tmp(c))	perror("AT Write Error  !!!! ");
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	double secs = (t_end.tv_sec - t_start->tv_sec) + (t_end.tv_nsec - t_start->tv_nsec) / 1e9;
+	if(secs > 0 && bytes > 0) {
+		double rate = bytes / secs;
+		link_rate = (link_rate > 0) ? 0.7 * link_rate + 0.3 * rate : rate;
+		cout << "link rate : " << (int)rate << " bytes/s" << endl;
 	}
+}
+
+const transport *find_transport(const char *name)
+{
+	for(size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+		if(0 == strcmp(transports[i].name, name)) return &transports[i];
+	return NULL;
+}
+
+// TCP/IP stack of the modem in transparent mode (same bring up as the GPS camera),
+// once. -1 if the GPRS connection could not be made.
+int open_ip_stack()
+{
+	apply_urcs();
+	if(ip_up) return 0;
 	
-	tx_enable=0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-	tx_enable=0;
-	if(-1 == uart_read_FTPPUT(l1)) perror("Serial Read Error  !!!! ");
+	tx_enable = 1;
+	if(-1 == run_script(ip_setup_script, sizeof(ip_setup_script) / sizeof(ip_setup_script[0]))) return -1;
 	
-	total_bytes += mod;
+	ip_up = 1;
+	return 0;
+}
+
+// Raw TCP to tcp_host:tcp_port in transparent mode: a "<remote name> <size>\n" line, then
+// the data, no per chunk commands at all. The receiver closes the connection once it
+// has size bytes, that CLOSED is the acknowledgement.
+int tcp_upload(const char *remote_name, const mem_buf *jpg)
+{
+	char hdr[160];
+	struct timespec t_start;
 	
-	close(fd);
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	if(-1 == open_ip_stack()) return -1;
 	
-	//total bytes written into the file
-	cout << "total bytes written : " << total_bytes << endl;
+	// AT+CIPSTART="TCP","host",port
+	tx_enable = 1;
+	snprintf(uart_str, sizeof(uart_str), "AT+CIPSTART=\"TCP\",\"%s\",%d", tcp_host, tcp_port);
+	strcat(uart_str,at_D);
+	cout << uart_str << endl;
+	if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+	if(-1 == uart_read_reply(TOK_CONNECT, ftp_reply_timeout)) {
+		ip_up = 0;
+		return -1;
+	}
+	
+	snprintf(hdr, sizeof(hdr), "%s %zu\n", remote_name, jpg->size);
+	if(-1 == uart_write_tmp((const unsigned char *)hdr, strlen(hdr)) || -1 == uart_write_tmp(jpg->data, jpg->size)) {
+		perror("AT Write Error  !!!! ");
+		ip_up = 0;
+		return -1;
+	}
+	
+	// the modem still has to get the data out, give it time at a slow link's pace
+	if(-1 == uart_read_reply(TOK_CLOSED, ftp_reply_timeout + jpg->size / 500)) {
+		// back to command mode: 1 s guard, +++, 1 s guard
+		sleep(1);
+		if(-1 == uart_write_tmp((const unsigned char *)"+++", 3)) perror("AT Write Error  !!!! ");
+		sleep(1);
+		ip_up = 0;
+		cout << "TCP upload of " << remote_name << " not acknowledged" << endl;
+		return -1;
+	}
+	
+	update_link_rate(jpg->size, &t_start);
+	cout<<"file uploaded successfully"<<endl;
+	return 0;
+}
 
-	//at+ftpput=2,0
-	if(tx_enable) {
-		strcpy(uart_str,"AT+FTPPUT=2,0");
-		strcat(uart_str,at_D);
-		cout << uart_str << endl;
-		if(-1 == uart_write())	perror("AT Write Error  !!!! ");
+// HTTP POST of the data to http_url?name=<remote name> over the SAPBR bearer. The whole
+// body goes to the modem in one AT+HTTPDATA, then one HTTPACTION sends it. 2xx is success.
+int http_upload(const char *remote_name, const mem_buf *jpg)
+{
+	int v[3];
+	struct timespec t_start;
+	
+	if(jpg->size > http_data_max) {
+		cout << remote_name << " is too big for AT+HTTPDATA, sent over FTP" << endl;
+		return upload_file(remote_name, jpg);
 	}
-	tx_enable = 0;
-	if(-1 == uart_read_OK()) perror("Serial Read Error  !!!! ");
-	tx_enable = 0;
-	if(-1 == uart_read_FTPPUT(l4)) perror("Serial Read Error  !!!! ");
 	
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	if(-1 == open_bearer()) return -1;
+	
+	// AT+HTTPTERM, a session left over from a failed upload would make HTTPINIT fail.
+	// ERROR when there is none, either answer will do.
+	tx_enable = 1;
+	cout << "AT+HTTPTERM" << endl;
+	at_command(at_eng, "AT+HTTPTERM", ftp_reply_timeout * 1000).get();
+	
+	// the session, then AT+HTTPDATA=<size>,<ms to send it in> -> DOWNLOAD
+	char para[400], data[48];
+	at_step steps[] = {
+		http_init_step,
+		at_step_fmt(para, sizeof(para), "OK", ftp_reply_timeout, false,
+		            "AT+HTTPPARA=\"CID\",1;+HTTPPARA=\"URL\",\"%s?name=%s\";+HTTPPARA=\"CONTENT\",\"%s\"\r",
+		            http_url, remote_name, strstr(remote_name, ".tar") ? "application/x-tar" : "image/jpeg"),
+		at_step_fmt(data, sizeof(data), "DOWNLOAD", ftp_reply_timeout, true, "AT+HTTPDATA=%zu,%d\r", jpg->size, 120000),
+	};
+	if(-1 == run_script(steps, sizeof(steps) / sizeof(steps[0]))) return -1;
+	
+	// the body, OK once the modem has all of it
+	if(-1 == uart_write_tmp(jpg->data, jpg->size)) {
+		perror("AT Write Error  !!!! ");
+		return -1;
+	}
+	if(-1 == uart_read_reply(TOK_OK, ftp_reply_timeout)) return -1;
+	
+	// AT+HTTPACTION=1 -> +HTTPACTION: 1,<status>,<length>
+	int n = -1;
+	if(0 == run_script(&http_action_step, 1)) n = uart_read_urc(TOK_HTTPACTION, v, http_action_timeout);
+	
+	cout << "AT+HTTPTERM" << endl;
+	at_command(at_eng, "AT+HTTPTERM", ftp_reply_timeout * 1000).get();
+	tx_enable = 1;
+	
+	if(n < 2 || v[1] < 200 || v[1] > 299) {
+		cout << "HTTP upload of " << remote_name << " failed, status " << (n >= 2 ? v[1] : -1) << endl;
+		return -1;
+	}
+	link_used = time(NULL);
+	update_link_rate(jpg->size, &t_start);
 	cout<<"file uploaded successfully"<<endl;
-			
+	return 0;
 }
@@ -0,0 +1,519 @@
+/* Fuzz and speed check of the modem input parsing of dcm_2_jpg_ftp.cpp:
+- at_input(): lines, URCs, the echo, final result codes and one line replies, the ring of the byte readers
+- uart_read_urc() and uart_read_reply(): the reply automaton and the +FTPPUT: style number tuples
+
+Inputs are mutated from a corpus: the modem dialogues below, plus files or serial traces
+(dcm_2_jpg_ftp -T, MODEM_EMULATOR -R) given on the command line. Each input goes through an
+engine with the URC table of at_start(), in random pieces, with no command out or with one,
+and is checked against plain references:
+- the byte readers get the input without its URC lines, the newest uart_ring_size bytes of it
+  and the rest counted as overrun; the URC handlers get those lines
+- a command out finishes on the first final result code (the first line, or "> ", when
+  one_line), with the lines before it, its echo and the URCs left out
+- the line being received stays within at_line_max
+- uart_read_urc() and uart_read_reply() stop where a search of the ring finds their token
+  or ERROR first, and give what sscanf() makes of the rest of the line
+A failing input is printed and saved to at_parser_fuzz.fail.
+
+	g++ -std=c++11 -O1 -g -fsanitize=address,undefined -pthread -o at_parser_fuzz at_parser_fuzz.cpp <dcmtk and bcm2835 libs as for dcm_2_jpg_ftp>
+	./at_parser_fuzz [-n runs] [-s seed] [corpus ..]	fuzz, 100000 runs by default
+	./at_parser_fuzz -b [corpus ..]					bytes/s of each parser
+
+With libFuzzer instead of the built in mutator:
+
+	clang++ -std=c++11 -DLIBFUZZER -g -fsanitize=fuzzer,address -pthread -o at_parser_fuzz at_parser_fuzz.cpp <libs>
+	./at_parser_fuzz -close_fd_mask=1 corpus_dir
+*/
+
+#define main dcm_2_jpg_ftp_main
+#include "../dcm_2_jpg_ftp.cpp"
+#undef main
+
+#include <fstream>
+
+// a reply with what the readers must make of it, independent of the token table
+struct known_reply {
+	const char *input;
+	int tok;
+	bool urc;			// uart_read_urc(), else uart_read_reply()
+	int ret;
+	int v[3];
+};
+
+// a command out while the input comes
+struct fuzz_cmd {
+	const char *cmd;
+	bool quiet;
+	bool one_line;
+};
+
+// what a reference says the engine should make of an input
+struct expect_out {
+	string ring;			// bytes for the byte readers, oldest dropped
+	size_t overrun;
+	vector<string> urcs;
+	bool   finished;
+	int    status;
+	vector<string> lines;	// the command's reply
+};
+
+// checks
+at_engine *make_engine();
+void feed(at_engine *, const string &, const fuzz_cmd *);
+void reference(const string &, const fuzz_cmd *, expect_out *);
+int  check_engine(const string &, const fuzz_cmd *);
+int  check_readers(const string &);
+int  check_known();
+int  check_input(const unsigned char *, size_t);
+
+// corpus and mutator
+int  load_corpus(const char *, vector<string> *);
+string mutate(const string &);
+
+// global constants
+const size_t fuzz_max_input = 3 * uart_ring_size;	// the ring overflows now and then
+const char *seed_inputs[] = {
+	"AT+FTPPUT=2,1360\r\r\n+FTPPUT: 2,1360\r\n",
+	"\r\nOK\r\n\r\n+FTPPUT: 1,1,1360\r\n",
+	"AT+FTPPUT=2,0\r\r\nOK\r\n\r\n+FTPPUT: 1,1,1360\r\n\r\n+FTPPUT: 1,0\r\n",
+	"AT+FTPPUT=1\r\r\nOK\r\n\r\n+FTPPUT: 1,61\r\n",
+	"AT+FTPSIZE\r\r\nOK\r\n\r\n+FTPSIZE: 1,0,16956\r\n",
+	"AT+SAPBR=2,1\r\r\n+SAPBR: 1,1,\"10.64.2.17\"\r\n\r\nOK\r\n",
+	"AT+CMGS=\"9886889561\"\r\r\n> ",
+	"\r\n+CMGS: 17\r\n\r\nOK\r\n",
+	"\r\n+CMS ERROR: 500\r\n",
+	"AT+CIPSTART=\"TCP\",\"www.kaimsofttech.com\",5000\r\r\nOK\r\n\r\nCONNECT FAIL\r\n",
+	"\r\nCONNECT\r\n",
+	"\r\nCLOSED\r\n",
+	"AT+CIPSHUT\r\r\nSHUT OK\r\n",
+	"AT+CIFSR\r\r\n10.64.2.17\r\n",
+	"AT+HTTPDATA=5000,120000\r\r\nDOWNLOAD\r\n",
+	"AT+HTTPACTION=1\r\r\nOK\r\n\r\n+HTTPACTION: 1,200,0\r\n",
+	"\r\n+SAPBR 1: DEACT\r\n\r\n+PDP: DEACT\r\n",
+	"\r\nRDY\r\n\r\n+CFUN: 1\r\n\r\n+CPIN: READY\r\n",
+	"\r\n+CMTI: \"SM\",3\r\n",
+	"\r\n+CME ERROR: 3\r\n",
+};
+const char *fuzz_tokens[] = {"OK", "ERROR", "FAIL", "CONNECT", "CLOSED", "+FTPPUT:", "+FTPSIZE:", "+CMGS:", "+HTTPACTION:",
+                             "\r\n", "\r", "> ", "RDY", "+PDP: DEACT", "+CMTI:", ",", " 1,1,1360", "99999999999", "-"};
+const fuzz_cmd fuzz_cmds[] = {
+	{ "AT+FTPPUT=2,0\r",           false, false },		// uart_write(), the byte readers have the reply
+	{ "AT+FTPPUT=2,1360\r",        false, false },
+	{ "AT+SAPBR=2,1\r",            true,  false },		// run_script()
+	{ "AT+CIFSR\r",                true,  true },
+	{ "AT+CMGS=\"9886889561\"\r",  true,  true },
+};
+const known_reply known_replies[] = {
+	{ "AT+FTPPUT=1\r\r\nOK\r\n\r\n+FTPPUT: 1,1,1360\r\n", TOK_FTPPUT, true, 3, {1, 1, 1360} },
+	{ "\r\n+FTPPUT: 2,0\r\n", TOK_FTPPUT, true, 2, {2, 0} },
+	{ "\r\n+FTPPUT: 1,61\r\n", TOK_FTPPUT, true, 2, {1, 61} },
+	{ "\r\nERROR\r\n\r\n+FTPPUT: 1,0\r\n", TOK_FTPPUT, true, -1, {0} },
+	{ "\r\n+FTPSIZE: 1,0,16956\r\n", TOK_FTPSIZE, true, 3, {1, 0, 16956} },
+	{ "\r\n+CMS ERROR: 500\r\n", TOK_CMGS, true, -1, {0} },
+	{ "\r\n+CMGS: 17\r\n", TOK_CMGS, true, 1, {17} },
+	{ "\r\n+HTTPACTION: 1,200,0\r\n", TOK_HTTPACTION, true, 3, {1, 200, 0} },
+	{ "\r\n+FTPPUT: 1,0", TOK_FTPPUT, true, -1, {0} },		// no line end yet
+	{ "\r\nOK\r\n\r\nCONNECT\r\n", TOK_CONNECT, false, 0, {0} },
+	{ "\r\nOK\r\n\r\nCONNECT FAIL\r\n", TOK_CONNECT, false, -1, {0} },
+	{ "\r\nALREADY CONNECT\r\n", TOK_CONNECT, false, 0, {0} },
+	{ "\r\nCLOSED\r\n", TOK_CLOSED, false, 0, {0} },
+	{ "\r\n+CME ERROR: 3\r\n\r\nOK\r\n", TOK_OK, false, -1, {0} },
+};
+const int urc_tokens[] = {TOK_FTPPUT, TOK_FTPSIZE, TOK_CMGS, TOK_HTTPACTION};
+const int reply_toks[] = {TOK_OK, TOK_CONNECT, TOK_CLOSED};
+
+// global variables
+FILE *report = stdout;
+vector<string> urc_seen;
+size_t max_line;			// longest line the engine held while fed
+at_result cmd_result;
+bool cmd_done;
+
+// An engine with the URC table of at_start(), on a pipe nobody writes to, its thread
+// stopped: the driver calls at_input() itself. The handlers only record their lines.
+at_engine *make_engine()
+{
+	int fds[2];
+	
+	if(-1 == pipe(fds)) { perror("pipe"); exit(2); }
+	at_engine *e = at_start(fds[0], NULL);
+	if(!e) exit(2);
+	{
+		lock_guard<mutex> lock(e->mtx);
+		e->stop = true;
+	}
+	at_wake(e);
+	e->th.join();
+	close(fds[1]);
+	for(size_t i = 0; i < e->urcs.size(); i++) e->urcs[i].second = [](const string &l) { urc_seen.push_back(l); };
+	return e;
+}
+
+// input through at_input() in random pieces, c out (NULL for none), from a clean engine
+void feed(at_engine *e, const string &input, const fuzz_cmd *c)
+{
+	vector<function<void()> > calls;
+	
+	e->line.clear();
+	e->released = 0;
+	e->out.head = e->out.tail = 0;
+	e->overrun = 0;
+	e->cmds.clear();
+	e->res.lines.clear();
+	e->busy = false;
+	urc_seen.clear();
+	max_line = 0;
+	cmd_result = at_result();
+	cmd_done = false;
+	if(c) {
+		at_request r;
+		r.cmd = c->cmd;
+		r.ms = 1000;
+		r.quiet = c->quiet;
+		r.one_line = c->one_line;
+		r.done = [](const at_result &res) { cmd_result = res; cmd_done = true; };
+		e->cmds.push_back(r);
+		e->busy = true;
+	}
+	
+	for(size_t pos = 0; pos < input.size(); ) {
+		size_t n = min(input.size() - pos, (size_t)(1 + rand() % 600));
+		at_input(e, input.data() + pos, n, &calls);
+		max_line = max(max_line, e->line.size());
+		pos += n;
+		for(size_t i = 0; i < calls.size(); i++) calls[i]();
+		calls.clear();
+	}
+}
+
+// What the engine should make of input, line by line
+void reference(const string &input, const fuzz_cmd *c, expect_out *x)
+{
+	string stream, cur;
+	
+	x->urcs.clear();
+	x->lines.clear();
+	x->finished = false;
+	x->status = -1;
+	for(size_t i = 0; i < input.size(); i++) {
+		char ch = input[i];
+		if(ch != '\r' && ch != '\n') {
+			cur += ch;
+			continue;
+		}
+		string l = cur.substr(0, at_line_max);
+		bool urc = false;
+		for(size_t u = 0; u < at_eng->urcs.size() && !urc; u++) urc = (0 == l.compare(0, at_eng->urcs[u].first.size(), at_eng->urcs[u].first));
+		if(urc) x->urcs.push_back(l);
+		else stream += cur;
+		stream += ch;
+		cur.clear();
+	
+		if(!c || x->finished || l.empty() || urc) continue;
+		if(c->one_line && 0 == l.compare(0, 2, "> ")) {
+			x->lines.push_back("> ");
+			x->finished = true;
+			x->status = AT_OK;
+			continue;
+		}
+		if(l + "\r" == c->cmd) continue;		// the echo
+		x->lines.push_back(l);
+		if(l == "OK" || l == "SHUT OK") x->status = AT_OK;
+		else if(l == "ERROR" || 0 == l.compare(0, 10, "+CME ERROR") || 0 == l.compare(0, 10, "+CMS ERROR")) x->status = AT_ERROR;
+		else if(c->one_line) x->status = AT_OK;
+		x->finished = (x->status != -1);
+	}
+	x->overrun = stream.size() > uart_ring_size ? stream.size() - uart_ring_size : 0;
+	x->ring = stream.substr(x->overrun);
+}
+
+static string printable(const string &in)
+{
+	string s;
+	for(size_t i = 0; i < in.size(); i++) s += (in[i] == '\r') ? "\\r" : (in[i] == '\n') ? "\\n" : string(1, in[i]);
+	return s;
+}
+
+static string ring_bytes(const uart_ring &r)
+{
+	string s;
+	for(unsigned i = r.head; i != r.tail; i++) s += (char)r.buf[i % uart_ring_size];
+	return s;
+}
+
+// 0 when the engine, with c out, does with input what the reference says
+int check_engine(const string &input, const fuzz_cmd *c)
+{
+	expect_out x;
+	
+	feed(at_eng, input, c);
+	reference(input, c, &x);
+	const char *what = c ? c->cmd : "no command";
+	
+	if(max_line > at_line_max || at_eng->out.tail - at_eng->out.head > uart_ring_size) {
+		fprintf(report, "%s: line of %zu, ring of %u bytes\n", what, max_line, at_eng->out.tail - at_eng->out.head);
+		return -1;
+	}
+	// a quiet command keeps its reply from the byte readers, and after a prompt the line
+	// starts again, so the URCs and ring are only checked line by line without those
+	if(!c || (!c->quiet && !c->one_line)) {
+		if(ring_bytes(at_eng->out) != x.ring || at_eng->overrun != x.overrun) {
+			fprintf(report, "%s: %u bytes for the byte readers (%zu overrun), not %zu (%zu)\n", what,
+			        at_eng->out.tail - at_eng->out.head, at_eng->overrun, x.ring.size(), x.overrun);
+			return -1;
+		}
+		if(urc_seen != x.urcs) {
+			fprintf(report, "%s: %zu URCs handled, not %zu\n", what, urc_seen.size(), x.urcs.size());
+			return -1;
+		}
+	}
+	if(!c) return 0;
+	
+	const vector<string> &lines = cmd_done ? cmd_result.lines : at_eng->res.lines;
+	if(cmd_done != x.finished || (cmd_done && cmd_result.status != x.status) || lines != x.lines) {
+		fprintf(report, "%s: %s with %zu lines, the reference %s %d with %zu\n", what, cmd_done ? "finished" : "still out",
+		        lines.size(), x.finished ? "finished" : "still out", x.status, x.lines.size());
+		return -1;
+	}
+	return 0;
+}
+
+// End of the first of the tokens in r, and which one (lowest id on a tie), npos for none
+static size_t first_token(const string &r, unsigned want, int *tok)
+{
+	size_t best = string::npos;
+	
+	for(int t = 0; t < TOK_COUNT; t++) {
+		if(!(want & 1u << t)) continue;
+		size_t at = r.find(reply_tokens[t]);
+		if(at == string::npos || (best != string::npos && at + strlen(reply_tokens[t]) >= best)) continue;
+		best = at + strlen(reply_tokens[t]);
+		*tok = t;
+	}
+	return best;
+}
+
+// 0 when uart_read_urc() and uart_read_reply() read the byte readers' share of input the way
+// a search of it does
+int check_readers(const string &input)
+{
+	int v[3] = {0, 0, 0}, tok = -1;
+	
+	feed(at_eng, input, NULL);
+	string r = ring_bytes(at_eng->out);
+	
+	// the URC and the numbers of the rest of its line
+	int want = urc_tokens[rand() % (sizeof(urc_tokens) / sizeof(urc_tokens[0]))];
+	size_t end = first_token(r, 1u << want | 1u << TOK_ERROR, &tok), used = r.size();
+	int n = -1, w[3] = {0, 0, 0};
+	if(end != string::npos) used = end;
+	if(end != string::npos && tok == want) {
+		size_t eol = r.find_first_of("\r\n", end);
+		if(eol != string::npos) {
+			n = sscanf(r.substr(end, min(eol - end, (size_t)63)).c_str(), "%d,%d,%d", &w[0], &w[1], &w[2]);
+			if(n < 0) n = 0;
+			used = eol + 1;
+		}
+		else used = r.size();
+	}
+	int got = uart_read_urc(want, v, 0);
+	size_t got_used = r.size() - (at_eng->out.tail - at_eng->out.head);
+	if(got != n || got_used != used || (n > 0 && memcmp(v, w, n * sizeof(int)))) {
+		fprintf(report, "uart_read_urc(%s) gave %d after %zu bytes (%d,%d,%d), not %d after %zu (%d,%d,%d)\n", reply_tokens[want],
+		        got, got_used, v[0], v[1], v[2], n, used, w[0], w[1], w[2]);
+		return -1;
+	}
+	
+	// a reply token in what is left
+	r = r.substr(used);
+	want = reply_toks[rand() % (sizeof(reply_toks) / sizeof(reply_toks[0]))];
+	end = first_token(r, 1u << want | 1u << TOK_ERROR | 1u << TOK_FAIL, &tok);
+	int ret = (end != string::npos && tok == want) ? 0 : -1;
+	used = (end != string::npos) ? end : r.size();
+	got = uart_read_reply(want, 0);
+	got_used = r.size() - (at_eng->out.tail - at_eng->out.head);
+	if(got != ret || got_used != used) {
+		fprintf(report, "uart_read_reply(%s) gave %d after %zu bytes, not %d after %zu\n", reply_tokens[want], got, got_used, ret, used);
+		return -1;
+	}
+	return 0;
+}
+
+// 0 when the readers get the fixed replies right
+int check_known()
+{
+	if(!at_eng) at_eng = make_engine();
+	for(size_t i = 0; i < sizeof(known_replies) / sizeof(known_replies[0]); i++) {
+		const known_reply &k = known_replies[i];
+		int v[3] = {0, 0, 0};
+		feed(at_eng, k.input, NULL);
+		int ret = k.urc ? uart_read_urc(k.tok, v, 0) : uart_read_reply(k.tok, 0);
+		if(ret != k.ret || (ret > 0 && memcmp(v, k.v, ret * sizeof(int)))) {
+			fprintf(report, "\"%s\": %d (%d,%d,%d), not %d\n", printable(k.input).c_str(), ret, v[0], v[1], v[2], k.ret);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// 0 when the engine and both readers agree with the references on input, -1 (reported) otherwise
+int check_input(const unsigned char *data, size_t size)
+{
+	// the line end flushes a URC prefix still held back
+	string input = string((const char *)data, min(size, fuzz_max_input)) + "\r\n";
+	
+	if(!at_eng) at_eng = make_engine();
+	if(-1 == check_engine(input, NULL)) return -1;
+	for(size_t i = 0; i < sizeof(fuzz_cmds) / sizeof(fuzz_cmds[0]); i++)
+		if(-1 == check_engine(input, &fuzz_cmds[i])) return -1;
+	return check_readers(input);
+}
+
+// The modem's side of a serial trace, or the whole file, cut to inputs
+int load_corpus(const char *path, vector<string> *corpus)
+{
+	FILE *f = fopen(path, "rb");
+	string data, in;
+	char buf[4096];
+	size_t n;
+	
+	if(!f) { perror(path); return -1; }
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+	fclose(f);
+	
+	if(0 == data.compare(0, sizeof(trace_magic) - 1, trace_magic)) {
+		for(size_t pos = sizeof(trace_magic) - 1; pos + sizeof(trace_rec) <= data.size(); ) {
+			trace_rec r;
+			memcpy(&r, data.data() + pos, sizeof(r));
+			pos += sizeof(r);
+			if(pos + r.len > data.size()) break;
+			if(r.dir == TRACE_RX) in.append(data, pos, r.len);
+			pos += r.len;
+		}
+	}
+	else in = data;
+	for(size_t pos = 0; pos < in.size(); pos += fuzz_max_input) corpus->push_back(in.substr(pos, fuzz_max_input));
+	return 0;
+}
+
+// A few random edits: bytes flipped, inserted or dropped, tokens inserted, ranges repeated
+string mutate(const string &in)
+{
+	string s = in;
+	int edits = 1 + rand() % 8;
+	
+	while(edits--) {
+		size_t at = s.empty() ? 0 : rand() % (s.size() + 1);
+		switch(rand() % 6) {
+		case 0: if(at < s.size()) s[at] ^= 1 << (rand() % 8); break;
+		case 1: s.insert(at, 1, (char)(rand() % 256)); break;
+		case 2: s.erase(at, rand() % 16); break;
+		case 3: s.insert(at, fuzz_tokens[rand() % (sizeof(fuzz_tokens) / sizeof(fuzz_tokens[0]))]); break;
+		case 4: s.insert(at, s.substr(rand() % (s.size() + 1), rand() % 64)); break;
+		case 5: s.insert(at, string(rand() % 2 ? 300 : 4200, 'A' + rand() % 26)); break;	// past at_line_max, past the ring
+		}
+	}
+	return s.substr(0, fuzz_max_input);
+}
+
+#ifdef LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static ofstream null_out("/dev/null");
+	cout.rdbuf(null_out.rdbuf());
+	static int known = check_known();
+	if(-1 == known || -1 == check_input(data, size)) abort();
+	return 0;
+}
+#else
+static double seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	long runs = 100000;
+	unsigned seed = time(NULL);
+	int bench = 0, opt;
+	vector<string> corpus;
+	
+	while((opt = getopt(argc, argv, "n:s:b")) != -1) {
+		switch(opt) {
+		case 'n': runs = atol(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		case 'b': bench = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-n runs] [-s seed] [-b] [corpus ..]\n", argv[0]);
+			return 2;
+		}
+	}
+	for(size_t i = 0; i < sizeof(seed_inputs) / sizeof(seed_inputs[0]); i++) corpus.push_back(seed_inputs[i]);
+	for(int i = optind; i < argc; i++) if(-1 == load_corpus(argv[i], &corpus)) return 2;
+	
+	// the readers print every reply they parse, that goes nowhere; the driver writes to stdout
+	static ofstream null_out("/dev/null");
+	cout.rdbuf(null_out.rdbuf());
+	setvbuf(report, NULL, _IOLBF, 0);
+	at_eng = make_engine();
+	
+	if(bench) {
+		static const reply_matcher m = build_reply_matcher();
+		vector<function<void()> > calls;
+		size_t bytes = 0;
+		for(size_t i = 0; i < corpus.size(); i++) bytes += corpus[i].size();
+		int reps = max(1, (int)(4000000 / max(bytes, (size_t)1)));
+	
+		double t = seconds();
+		unsigned hits = 0;
+		for(int r = 0; r < reps; r++)
+			for(size_t i = 0; i < corpus.size(); i++) {
+				int st = 0;
+				for(size_t k = 0; k < corpus[i].size(); k++) hits += m.out[st = m.next[st][(unsigned char)corpus[i][k]]];
+			}
+		fprintf(report, "reply automaton          %10.1f MB/s (%u)\n", reps * bytes / (seconds() - t) / 1e6, hits & 1);
+	
+		// lines, URCs and the ring, with a command of the byte readers out
+		t = seconds();
+		for(int r = 0; r < reps; r++)
+			for(size_t i = 0; i < corpus.size(); i++) {
+				if(!at_eng->busy) feed(at_eng, "", &fuzz_cmds[0]);
+				at_input(at_eng, corpus[i].data(), corpus[i].size(), &calls);
+				calls.clear();
+				at_eng->out.head = at_eng->out.tail;
+			}
+		fprintf(report, "at_input                 %10.1f MB/s\n", reps * bytes / (seconds() - t) / 1e6);
+	
+		// a chunk grant at a time out of a full ring
+		const string grant = "\r\n+FTPPUT: 1,1,1360\r\n";
+		long calls_n = 0;
+		int v[3];
+		t = seconds();
+		for(int r = 0; r < reps; r++) {
+			feed(at_eng, "", NULL);
+			while(at_eng->out.tail - at_eng->out.head + grant.size() <= uart_ring_size)
+				for(size_t k = 0; k < grant.size(); k++) at_eng->out.buf[at_eng->out.tail++ % uart_ring_size] = grant[k];
+			while(uart_read_urc(TOK_FTPPUT, v, 0) == 3) calls_n++;
+		}
+		fprintf(report, "uart_read_urc            %10.0f calls/s\n", calls_n / (seconds() - t));
+		return 0;
+	}
+	
+	if(-1 == check_known()) return 1;
+	srand(seed);
+	fprintf(report, "%ld runs, seed %u, %zu corpus inputs\n", runs, seed, corpus.size());
+	for(long r = 0; r < runs; r++) {
+		string in = (r < (long)corpus.size()) ? corpus[r] : mutate(corpus[rand() % corpus.size()]);
+		if(0 == check_input((const unsigned char *)in.data(), in.size())) continue;
+	
+		fprintf(report, "run %ld failed, input saved to at_parser_fuzz.fail\n", r);
+		FILE *f = fopen("at_parser_fuzz.fail", "wb");
+		if(f) { fwrite(in.data(), 1, in.size(), f); fclose(f); }
+		return 1;
+	}
+	fprintf(report, "all passed\n");
+	return 0;
+}
+#endif
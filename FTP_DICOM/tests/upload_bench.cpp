@@ -0,0 +1,126 @@
+/* Upload timings of dcm_2_jpg_ftp.cpp: synthetic buffers of fixed sizes through upload_file(),
+tcp_upload() and http_upload(), against a modem or the PTY of MODEM_EMULATOR.
+
+	g++ -std=c++11 -O2 -pthread -o upload_bench upload_bench.cpp <dcmtk, bcm2835 and jpeg libs as for dcm_2_jpg_ftp>
+	modem_emulator -l /tmp/ttyGSM0 -r 300 -b 20000 &
+	./upload_bench -m /tmp/ttyGSM0 [-t ftp,tcp,http] [-z 4096,32768,262144] [-n runs] [-T trace_prefix]
+
+Buffers are random bytes, as incompressible as a JPEG, the same for every transport.
+Each size is uploaded n times per transport. The table has the successful uploads,
+the fastest, median and slowest time, and the median rate. The emulator prints its own
+view of the same uploads (round trips, time per phase) when stopped. With -g 100 on the
+emulator every FTPPUT grant comes late, the last one after the OK of the close.
+*/
+
+#define main dcm_2_jpg_ftp_main
+#include "../dcm_2_jpg_ftp.cpp"
+#undef main
+
+#include <algorithm>
+
+// bench
+int  parse_sizes(const char *, vector<size_t> *);
+void bench_size(const transport *, size_t, int);
+
+// global constants
+const char *bench_sizes = "4096,32768,262144";
+
+static double seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// "4096,32k,1m" into sizes, -1 if a size doesn't parse
+int parse_sizes(const char *list, vector<size_t> *sizes)
+{
+	while(*list) {
+		char *end;
+		unsigned long n = strtoul(list, &end, 10);
+		if(end == list || n == 0) return -1;
+		if(*end == 'k' || *end == 'K') { n <<= 10; end++; }
+		else if(*end == 'm' || *end == 'M') { n <<= 20; end++; }
+		if(*end != ',' && *end != 0) return -1;
+		sizes->push_back(n);
+		list = *end ? end + 1 : end;
+	}
+	return sizes->empty() ? -1 : 0;
+}
+
+// n uploads of size bytes through x, one line of the table
+void bench_size(const transport *x, size_t size, int runs)
+{
+	mem_buf buf;
+	vector<double> times;
+	char name[64];
+	
+	buf.size = size;
+	buf.data = (unsigned char *)malloc(size);
+	if(!buf.data) { perror("malloc"); exit(2); }
+	srand(size);
+	for(size_t i = 0; i < size; i++) buf.data[i] = rand();
+	
+	for(int r = 0; r < runs; r++) {
+		snprintf(name, sizeof(name), "bench_%s_%zu_%d.jpeg", x->name, size, r);
+		double t = seconds();
+		if(0 == x->put(name, &buf)) times.push_back(seconds() - t);
+		else cerr << name << " failed" << endl;
+	}
+	free(buf.data);
+	
+	printf("%-5s %9zu %4zu/%-4d", x->name, size, times.size(), runs);
+	if(times.empty()) { printf("\n"); return; }
+	sort(times.begin(), times.end());
+	double median = times[times.size() / 2];
+	printf(" %9.2f %9.2f %9.2f %10.0f\n", times.front(), median, times.back(), size / median);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dev = NULL, *xports = "ftp,tcp,http", *size_list = bench_sizes;
+	vector<size_t> sizes;
+	int runs = 3, opt;
+	
+	while((opt = getopt(argc, argv, "m:t:z:n:T:")) != -1) {
+		switch(opt) {
+		case 'm': dev = optarg; break;
+		case 't': xports = optarg; break;
+		case 'z': size_list = optarg; break;
+		case 'n': runs = atoi(optarg); break;
+		case 'T': trace_prefix = optarg; break;
+		default:
+			cerr << "usage: " << argv[0] << " -m modem [-t ftp,tcp,http] [-z sizes] [-n runs] [-T trace_prefix]" << endl;
+			return 2;
+		}
+	}
+	if(!dev || runs < 1 || -1 == parse_sizes(size_list, &sizes)) {
+		cerr << "usage: " << argv[0] << " -m modem [-t ftp,tcp,http] [-z sizes] [-n runs] [-T trace_prefix]" << endl;
+		return 2;
+	}
+	
+	// transports by name, checked before the modem is touched
+	vector<const transport *> xs;
+	for(const char *p = xports; *p; ) {
+		size_t len = strcspn(p, ",");
+		const transport *x = find_transport(string(p, len).c_str());
+		if(!x) { cerr << "Unknown transport " << string(p, len) << endl; return 2; }
+		xs.push_back(x);
+		p += len + (p[len] == ',');
+	}
+	
+	// the table goes to stdout, the modem code's chatter to stderr
+	streambuf *table = cout.rdbuf(cerr.rdbuf());
+	if(-1 == (uart0_filestream = open_modem(dev))) return 1;
+	
+	printf("%-5s %9s %9s %9s %9s %9s %10s\n", "xport", "bytes", "ok/runs", "min s", "median s", "max s", "bytes/s");
+	fflush(stdout);
+	for(size_t t = 0; t < xs.size(); t++)
+		for(size_t i = 0; i < sizes.size(); i++) {
+			bench_size(xs[t], sizes[i], runs);
+			fflush(stdout);
+		}
+	close_modem();
+	cout.rdbuf(table);
+	return 0;
+}
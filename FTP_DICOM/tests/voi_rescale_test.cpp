@@ -0,0 +1,157 @@
+/* Bit exactness of the windowing kernel of dcm_2_jpg_ftp.cpp: voi_rescale() against
+voi_rescale_scalar(), byte for byte, over random maps and pixels.
+
+The vector unit is picked at compile time, build and run once per target:
+
+	g++ -std=c++11 -O2 -msse2 -o voi_rescale_test voi_rescale_test.cpp <dcmtk and bcm2835 libs as for dcm_2_jpg_ftp>
+	g++ -std=c++11 -O2 -mavx2 ...
+	g++ -std=c++11 -O2 -mfpu=neon ...			(Pi 3/4, aarch64 needs no flag)
+	./voi_rescale_test [-n maps] [-s seed]
+
+Maps cover 8 to 16 stored bits, signed and unsigned data, positive and negative slopes,
+windows inside, around and outside the stored range, and inversion. Pixels are random
+in all 16 bits, so the bits above bits stored are checked to be ignored, and runs start
+at odd offsets with odd lengths, so the scalar tails and unaligned loads are covered.
+*/
+
+#define main dcm_2_jpg_ftp_main
+#include "../dcm_2_jpg_ftp.cpp"
+#undef main
+
+// checks
+int  check_map(const voi_map *, const Uint16 *, size_t);
+void random_map(voi_map *, int, int);
+void print_map(const voi_map *);
+
+// global constants
+const size_t test_pixels = 4099;		// prime, whole SIMD steps plus a tail
+const char *kernel_name =
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	"NEON";
+#elif defined(__AVX2__)
+	"AVX2";
+#elif defined(__SSE2__)
+	"SSE2";
+#else
+	"scalar only";
+#endif
+
+// Uniform in [lo, hi)
+static double uniform(double lo, double hi)
+{
+	return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0));
+}
+
+// A window over the stored range of bits, or well off it on either side
+void random_map(voi_map *m, int bits, int is_signed)
+{
+	double range = ldexp(1.0, bits);
+	double xmin = is_signed ? -range / 2 : 0;
+	double slope = (rand() % 4) ? 1.0 : uniform(-4, 4);
+	double intercept = (rand() % 2) ? 0 : uniform(-range, range);
+	double center = uniform(xmin - range / 4, xmin + range * 1.25) * fabs(slope) + intercept;
+	double width;
+	
+	switch(rand() % 4) {
+	case 0:  width = 1 + rand() % 8; break;					// threshold like
+	case 1:  width = uniform(2, 256); break;
+	case 2:  width = uniform(256, range); break;
+	default: width = uniform(range, 4 * range); break;		// shallower than 1 level a value
+	}
+	if(-1 == setup_voi_map(m, bits, is_signed, slope, intercept, center, width, rand() % 2)) {
+		printf("setup_voi_map(%d bits) failed\n", bits);
+		exit(1);
+	}
+}
+
+void print_map(const voi_map *m)
+{
+	printf("mask %04x shift %d signed %d lo %u span %u mul %u add %d frac %d invert %d\n",
+	       m->mask, m->shift, m->is_signed, m->lo, m->span, m->mul, m->add, m->frac, m->invert);
+}
+
+// 0 when voi_rescale() matches voi_rescale_scalar() on every offset and length tried
+int check_map(const voi_map *m, const Uint16 *src, size_t n)
+{
+	vector<unsigned char> want(n + 1), got(n + 1);
+	
+	voi_rescale_scalar(m, src, &want[0], n);
+	for(size_t start = 0; start < 4 && start < n; start++) {
+		// lengths around each step size, and the rest of the buffer
+		size_t lens[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 65, n - start};
+		for(size_t k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+			size_t len = lens[k];
+			if(start + len > n) continue;
+	
+			got[start + len] = 0xA5;		// guard after the run
+			voi_rescale(m, src + start, &got[start], len);
+			if(got[start + len] != 0xA5) {
+				printf("voi_rescale() wrote past %zu pixels\n", len);
+				return -1;
+			}
+			for(size_t i = start; i < start + len; i++) {
+				if(got[i] == want[i]) continue;
+				printf("pixel %zu (offset %zu, length %zu): stored %04x, scalar %u, %s %u\n",
+				       i, start, len, src[i], want[i], kernel_name, got[i]);
+				print_map(m);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long maps = 20000;
+	unsigned seed = time(NULL);
+	int opt, bits_list[] = {8, 10, 12, 14, 15, 16};
+	vector<Uint16> src(test_pixels);
+	voi_map m;
+	
+	while((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch(opt) {
+		case 'n': maps = atol(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n maps] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+	srand(seed);
+	printf("%s kernel, %ld maps, seed %u\n", kernel_name, maps, seed);
+	
+	for(long r = 0; r < maps; r++) {
+		int bits = bits_list[rand() % (sizeof(bits_list) / sizeof(bits_list[0]))];
+		int is_signed = rand() % 2;
+		random_map(&m, bits, is_signed);
+	
+		// all 16 bits random, or clustered around the window edges
+		for(size_t i = 0; i < test_pixels; i++) {
+			src[i] = (Uint16)(rand() ^ ((unsigned)rand() << 8));
+			if(rand() % 2) {
+				int edge = (rand() % 2) ? m.lo : m.lo + m.span;
+				if(m.is_signed) edge ^= 0x8000;
+				src[i] = (Uint16)(edge + rand() % 5 - 2);
+			}
+		}
+		if(-1 == check_map(&m, &src[0], test_pixels)) {
+			printf("map %ld of seed %u differs\n", r, seed);
+			return 1;
+		}
+	}
+	
+	// the extremes of every stored value, both signs and both polarities
+	for(int bits = 1; bits <= 16; bits++)
+		for(int is_signed = 0; is_signed < 2; is_signed++)
+			for(int invert = 0; invert < 2; invert++) {
+				for(size_t i = 0; i < test_pixels; i++) src[i] = (Uint16)(i * 16411);
+				double range = ldexp(1.0, bits);
+				setup_voi_map(&m, bits, is_signed, 1, 0, is_signed ? 0 : range / 2, range, invert);
+				if(-1 == check_map(&m, &src[0], test_pixels)) return 1;
+				setup_voi_map(&m, bits, is_signed, -1, 0, 0, 2, invert);
+				if(-1 == check_map(&m, &src[0], test_pixels)) return 1;
+			}
+	printf("all identical\n");
+	return 0;
+}
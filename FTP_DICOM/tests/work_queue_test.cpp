@@ -0,0 +1,302 @@
+/* Replay and compaction of the watch mode's work queue (wq_* of dcm_2_jpg_ftp.cpp): the queue
+is driven through adds, takes, retries and done / failed, reopened from its files, and compared
+with what it should hold, down to the failed uploads of each entry. Retries must back off and
+stop at upload_attempts_max. The files are then damaged the way a power cut does:
+
+- the journal cut at every byte of its last records, the queue must come back as it was after
+  the last whole record, and take new records after the cut
+- a record corrupted in the middle, replay stops in front of it
+- compaction, and a crash between the new index and the emptied journal (both replayed)
+
+	g++ -std=c++11 -O1 -g -pthread -o work_queue_test work_queue_test.cpp <dcmtk and bcm2835 libs as for dcm_2_jpg_ftp>
+	./work_queue_test [-s seed]
+*/
+
+#define main dcm_2_jpg_ftp_main
+#include "../dcm_2_jpg_ftp.cpp"
+#undef main
+
+#include <fstream>
+#include <algorithm>
+
+// what the queue should hold once reopened: entries not done, all pending again, with
+// the failed uploads they had
+struct model_entry {
+	string path;
+	int    priority;
+	int    attempts;
+};
+typedef map<uint64_t, model_entry> queue_model;
+
+// checks
+int  check_queue(const char *, const queue_model &, const char *);
+void apply_op(work_queue *, queue_model *, int);
+long file_size(const string &);
+vector<long> record_ends(const string &);
+
+// global variables
+string test_dir;
+int    op_count;
+int    retry_fails;
+
+long file_size(const string &path)
+{
+	struct stat st;
+	return (-1 == stat(path.c_str(), &st)) ? -1 : st.st_size;
+}
+
+// 0, then the offset after each record of a journal written whole
+vector<long> record_ends(const string &path)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	vector<long> ends(1, 0);
+	journal_rec rec;
+	
+	if(!f) { perror(path.c_str()); exit(2); }
+	while(1 == fread(&rec, sizeof(rec), 1, f) && 0 == fseek(f, rec.path_len, SEEK_CUR))
+		ends.push_back(ftell(f));
+	fclose(f);
+	return ends;
+}
+
+static void copy_file(const string &from, const string &to)
+{
+	FILE *in = fopen(from.c_str(), "rb"), *out = fopen(to.c_str(), "wb");
+	char buf[4096];
+	size_t n;
+	
+	if(!in || !out) { perror("copy"); exit(2); }
+	while((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+	fclose(in);
+	fclose(out);
+}
+
+// 0 when the queue of dir, opened afresh, holds model. Closes it again.
+int check_queue(const char *dir, const queue_model &model, const char *what)
+{
+	work_queue *wq = new work_queue();
+	int ret = 0;
+	
+	if(-1 == wq_open(wq, dir)) {
+		printf("%s: wq_open failed\n", what);
+		delete wq;
+		return -1;
+	}
+	if(wq->entries.size() != model.size() || wq->paths.size() != model.size()) {
+		printf("%s: %zu entries, %zu paths, %zu expected\n", what, wq->entries.size(), wq->paths.size(), model.size());
+		ret = -1;
+	}
+	for(queue_model::const_iterator it = model.begin(); it != model.end() && ret == 0; ++it) {
+		map<uint64_t, queue_entry>::iterator e = wq->entries.find(it->first);
+		if(e == wq->entries.end() || e->second.path != it->second.path || e->second.priority != it->second.priority ||
+		   e->second.attempts != it->second.attempts || e->second.state != JOB_PENDING || !wq->paths.count(it->second.path)) {
+			printf("%s: entry %llu lost or changed\n", what, (unsigned long long)it->first);
+			ret = -1;
+		}
+		if(it->first >= wq->next_id) {
+			printf("%s: next id %llu would reuse %llu\n", what, (unsigned long long)wq->next_id, (unsigned long long)it->first);
+			ret = -1;
+		}
+	}
+	wq_close(wq);
+	delete wq;
+	return ret;
+}
+
+// One random step of the watch mode on wq, mirrored in model
+void apply_op(work_queue *wq, queue_model *model, int pick)
+{
+	char path[128];
+	queue_entry e;
+	bool due = false;
+	int delay;
+	
+	switch(model->empty() ? 0 : pick % 5) {
+	case 0:
+	case 1:
+		// names of every length, the long ones across the 100 byte mark
+		snprintf(path, sizeof(path), "/spool/%0*d.dcm", 1 + rand() % 110, op_count++);
+		e.priority = rand() % 2;
+		if(0 == wq_add(wq, path, e.priority)) (*model)[wq->next_id - 1] = {path, e.priority, 0};
+		break;
+	case 2:
+		// wq_take waits while nothing is due
+		for(map<uint64_t, queue_entry>::iterator it = wq->entries.begin(); it != wq->entries.end(); ++it)
+			due = due || (it->second.state == JOB_PENDING && it->second.not_before <= time(NULL));
+		if(due && wq_take(wq, &e)) wq_set_state(wq, e.id, JOB_UPLOADING);
+		break;
+	case 3:
+		e.id = next(model->begin(), rand() % model->size())->first;
+		wq_set_state(wq, e.id, (rand() % 4) ? JOB_DONE : JOB_FAILED);
+		model->erase(e.id);
+		break;
+	case 4:
+		// backs off, and refuses once the entry failed upload_attempts_max times
+		e.id = next(model->begin(), rand() % model->size())->first;
+		e.attempts = (*model)[e.id].attempts;
+		delay = wq_retry(wq, e.id);
+		if(delay != (e.attempts + 1 >= upload_attempts_max ? -1 : min(link_retry_min << min(e.attempts, 5), link_retry_max))) {
+			printf("retry %d of %llu: delay %d\n", e.attempts + 1, (unsigned long long)e.id, delay);
+			retry_fails++;
+		}
+		if(delay != -1) (*model)[e.id].attempts++;
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned seed = time(NULL);
+	char tmpl[] = "/tmp/work_queue_test.XXXXXX";
+	int opt, fails = 0;
+	
+	while((opt = getopt(argc, argv, "s:")) != -1) {
+		if(opt == 's') seed = atoi(optarg);
+		else { fprintf(stderr, "usage: %s [-s seed]\n", argv[0]); return 2; }
+	}
+	srand(seed);
+	if(!mkdtemp(tmpl)) { perror("mkdtemp"); return 2; }
+	test_dir = tmpl;
+	string journal = test_dir + "/queue.journal", index = test_dir + "/queue.index";
+	printf("seed %u, files in %s\n", seed, tmpl);
+	
+	// the queue's own chatter ("n files still queued") is not what is tested
+	static ofstream null_out("/dev/null");
+	streambuf *out = cout.rdbuf(null_out.rdbuf());
+	
+	// a few hundred steps below the compaction threshold, reopened every 40: the model after
+	// every step and where its record ends in the journal
+	queue_model model;
+	vector<queue_model> after;
+	vector<long> ends;
+	work_queue *wq = new work_queue();
+	if(-1 == wq_open(wq, tmpl)) { printf("wq_open failed\n"); return 1; }
+	for(int i = 0; i < 200; i++) {
+		apply_op(wq, &model, rand());
+		after.push_back(model);
+		ends.push_back(file_size(journal));
+		if(i % 40 == 39) {
+			wq_close(wq);
+			delete wq;
+			if(-1 == check_queue(tmpl, model, "reopen")) fails++;
+			wq = new work_queue();
+			wq_open(wq, tmpl);
+		}
+	}
+	wq_close(wq);
+	delete wq;
+	if(file_size(index) > 0) printf("compacted below the threshold, the cuts below prove less\n");
+	
+	// cut inside each of the last steps: back to the step before, the journal cut to its last
+	// whole record (a take writes two)
+	copy_file(journal, journal + ".whole");
+	vector<long> bounds = record_ends(journal);
+	for(size_t k = ends.size() - 12; k < ends.size() && fails < 5; k++) {
+		if(ends[k] == ends[k - 1]) continue;		// the step wrote nothing
+		for(long cut = ends[k - 1] + 1; cut < ends[k] && fails < 5; cut++) {
+			copy_file(journal + ".whole", journal);
+			if(-1 == truncate(journal.c_str(), cut)) { perror("truncate"); return 2; }
+			char what[64];
+			snprintf(what, sizeof(what), "cut at %ld in step %zu", cut, k);
+			long good = *(upper_bound(bounds.begin(), bounds.end(), cut) - 1);
+			if(-1 == check_queue(tmpl, after[k - 1], what)) fails++;
+			else if(file_size(journal) != good) {
+				printf("%s: torn tail left in the journal (%ld bytes, %ld good)\n", what, file_size(journal), good);
+				fails++;
+			}
+		}
+	}
+	
+	// after a cut the journal goes on: what is added then is there on the next start
+	copy_file(journal + ".whole", journal);
+	if(-1 == truncate(journal.c_str(), ends.back() - 3)) { perror("truncate"); return 2; }
+	model = after[after.size() - 2];
+	wq = new work_queue();
+	wq_open(wq, tmpl);
+	for(int i = 0; i < 10; i++) apply_op(wq, &model, 0);
+	wq_close(wq);
+	delete wq;
+	if(-1 == check_queue(tmpl, model, "records after a cut")) fails++;
+	
+	// a record corrupted in the middle: replay keeps what is in front of it
+	copy_file(journal + ".whole", journal);
+	size_t mid = ends.size() / 2;
+	while(ends[mid] == ends[mid - 1]) mid++;
+	FILE *f = fopen(journal.c_str(), "r+b");
+	fseek(f, ends[mid - 1] + sizeof(journal_rec) - 2, SEEK_SET);	// inside the path length
+	fputc(fgetc(f) ^ 0x40, f);
+	fclose(f);
+	if(-1 == check_queue(tmpl, after[mid - 1], "corrupt record")) fails++;
+	
+	// compaction: enough done entries and the journal is folded into the index
+	copy_file(journal + ".whole", journal);
+	model = after.back();
+	wq = new work_queue();
+	wq_open(wq, tmpl);
+	string before_compaction = journal + ".before";
+	while(file_size(index) <= 0) {
+		// entries done until one more add would compact, the journal kept from before that add
+		long r = wq->records + 1;
+		bool add_compacts  = r > journal_compact_min && r > 4 * (long)(wq->entries.size() + 1);
+		bool done_compacts = r > journal_compact_min && r > 4 * ((long)wq->entries.size() - 1);
+		if(add_compacts) copy_file(journal, before_compaction);
+		apply_op(wq, &model, (add_compacts || done_compacts || model.size() < 2) ? 0 : 3);
+	}
+	long index_size = file_size(index), journal_size = file_size(journal);
+	wq_close(wq);
+	delete wq;
+	if(index_size <= 0 || journal_size != 0) {
+		printf("no compaction (index %ld bytes, journal %ld bytes)\n", index_size, journal_size);
+		fails++;
+	}
+	if(-1 == check_queue(tmpl, model, "compacted")) fails++;
+	
+	// a crash after the index rename, before the journal was emptied: both are replayed.
+	// The record that started the compaction is only in the index, an add that doesn't matter.
+	copy_file(before_compaction, journal);
+	if(-1 == check_queue(tmpl, model, "index and old journal")) fails++;
+	
+	// and a cut journal on top of a compacted index
+	copy_file(journal, journal + ".whole");
+	if(-1 == truncate(journal.c_str(), 0)) { perror("truncate"); return 2; }
+	wq = new work_queue();
+	wq_open(wq, tmpl);
+	for(int i = 0; i < 5; i++) apply_op(wq, &model, 0);
+	wq_close(wq);
+	delete wq;
+	long good = file_size(journal);
+	if(-1 == truncate(journal.c_str(), good - 1)) { perror("truncate"); return 2; }
+	queue_model last = model;
+	last.erase(prev(last.end()));
+	if(-1 == check_queue(tmpl, last, "index, then a cut journal")) fails++;
+	
+	// an entry failing again and again: its count survives a restart, the last retry is refused
+	model = last;
+	wq = new work_queue();
+	wq_open(wq, tmpl);
+	apply_op(wq, &model, 0);
+	uint64_t id = prev(model.end())->first;
+	for(int i = 1; i < upload_attempts_max; i++) wq_retry(wq, id);
+	model[id].attempts = upload_attempts_max - 1;
+	wq_close(wq);
+	delete wq;
+	if(-1 == check_queue(tmpl, model, "retried to the limit")) fails++;
+	wq = new work_queue();
+	wq_open(wq, tmpl);
+	if(-1 != wq_retry(wq, id)) {
+		printf("retry %d after a restart not refused\n", upload_attempts_max);
+		fails++;
+	}
+	wq_close(wq);
+	delete wq;
+	
+	cout.rdbuf(out);
+	fails += retry_fails;
+	if(fails) {
+		printf("%d failed, files left in %s\n", fails, tmpl);
+		return 1;
+	}
+	if(0 != system(("rm -rf " + test_dir).c_str())) perror("rm");
+	printf("all passed\n");
+	return 0;
+}
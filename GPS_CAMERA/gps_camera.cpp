@@ -10,6 +10,8 @@ Also image is stored at the stoppage of the vehicle
 */
 
 #include <iostream>
+#include <vector>
+#include <deque>
 using namespace std;
 
 #include <bcm2835.h>
@@ -23,6 +25,9 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
 
 #define SYS_START	10
 #define SYS_STOP	20
@@ -31,12 +36,57 @@ using namespace std;
 // init serial port 
 void init_uart();
 
+// port rate and flow control, modem probe, rate negotiation
+int uart_set_rate(int, int);
+int uart_probe(const char *, int);
+int negotiate_baud();
+
 //writes to uart
 void uart_write();
 
 // reads from uart
 void uart_read_until(const char *);
 
+// one line of an AT script: the frame, CR included, and the response that ends it
+struct at_step {
+	const char *frame;
+	size_t      len;
+	const char *until;		// one of reply_tokens
+	int         times;		// responses to wait for
+};
+
+// frame and length of a literal, both known at compile time
+#define AT_FRAME(s)	s, sizeof(s) - 1
+
+// runs an AT script
+void run_script(const at_step *, size_t);
+
+// bytes from the GSM board not consumed yet, filled a burst at a time
+const unsigned uart_ring_size = 1024;
+struct uart_ring {
+	unsigned char buf[uart_ring_size];
+	unsigned head, tail;		// free running, head == tail when empty
+};
+
+// serial trace, second argument: trace_magic, then a record for every read and write of the
+// GSM board, each followed by its bytes. Host byte order. MODEM_EMULATOR -R plays it back.
+struct trace_rec {
+	uint32_t ms;		// CLOCK_MONOTONIC, only the difference between records counts
+	uint16_t len;
+	uint8_t  dir;		// TRACE_RX from the board, TRACE_TX to it
+	uint8_t  spare;
+};
+enum { TRACE_RX, TRACE_TX };
+void trace_open(const char *);
+void trace_bytes(int, const void *, size_t);
+
+// responses uart_read_until() waits for, matched together in one pass
+enum { TOK_OK, TOK_ERROR, TOK_MSG, TOK_IP_INITIAL, TOK_IP_START, TOK_DOT, TOK_MSGOVER, TOK_COUNT };
+struct reply_matcher {
+	vector<vector<short> > next;	// state x byte -> state
+	vector<unsigned> out;			// tokens ending in a state, bit per token
+};
+
 // send sms
 void send_sms();
 
@@ -52,9 +102,17 @@ void get_gps_coordinates();
 // read sms
 int read_sms();
 
+// vehicle stopped: picture, position by SMS
+int stop_state();
+int take_picture();
+
+// gps_str from the CGPSINF response in uart_read_str
+int process_gps_coordinates();
+
 // global constants
-const char at_D[] = {0x0D};
-const char at_A[] = {0x1A};
+const char at_D[] = {0x0D, 0};
+const char at_A[] = {0x1A, 0};
+const char trace_magic[] = "ATTRACE1";
 
 // response strings
 const char *OK 				= "OK";
@@ -62,6 +120,34 @@ const char *MSG 			= ">";
 const char *ST_IP_INITIAL 	= "STATE: IP INITIAL";
 const char *ST_IP_START   	= "STATE: IP START";
 const char *DOT 			= ".";
+const char *reply_tokens[TOK_COUNT] = {OK, "ERROR", MSG, ST_IP_INITIAL, ST_IP_START, DOT, "MSGOVER"};
+
+// AT scripts. Settings that don't depend on each other share one ';' separated line, one
+// round trip for all of them.
+constexpr at_step gps_init_script[] = {
+	{ AT_FRAME("AT+CGPSPWR=1;+CGPSRST=1;+CFUN=1\r"),          "OK",                1 },
+	{ AT_FRAME("AT+CIPSHUT\r"),                               "OK",                1 },
+	{ AT_FRAME("AT+CIPSTATUS\r"),                             "STATE: IP INITIAL", 1 },
+	{ AT_FRAME("AT+CGDCONT=1,\"IP\",\r"),                     "OK",                1 },	// context, activation and attach depend
+	{ AT_FRAME("AT+CGACT=1,1\r"),                             "OK",                1 },	// on each other, one at a time
+	{ AT_FRAME("AT+CGATT=1\r"),                               "OK",                1 },
+	{ AT_FRAME("AT+CIPSTATUS\r"),                             "STATE: IP INITIAL", 1 },
+	{ AT_FRAME("AT+CSTT\r"),                                  "OK",                1 },
+	{ AT_FRAME("AT+CIPSTATUS\r"),                             "STATE: IP START",   1 },
+	{ AT_FRAME("AT+CIICR\r"),                                 "OK",                1 },
+	{ AT_FRAME("AT+CIFSR\r"),                                 ".",                 3 },	// the IP address
+	{ AT_FRAME("AT+CGPSINF=32\r"),                            "OK",                1 },
+};
+constexpr at_step gps_read_script[] = {
+	{ AT_FRAME("AT+CGPSINF=32\r"), "OK", 1 },
+};
+constexpr at_step sms_setup_script[] = {
+	{ AT_FRAME("AT+CMGF=1\r"), "OK", 1 },
+};
+
+// uart rates, fastest first
+const int uart_rates[]		= {460800, 230400, 115200, 57600, 38400, 19200, 9600};
+const int uart_default_rate	= 115200;
 
 // global variables
 char uart_write_str[110];
@@ -69,10 +155,25 @@ char uart_read_str[256];
 char gps_str[100];
 int  uart0_filestream 	= -1;
 int  sys_state			=  0;
+uart_ring rx;
+const char *uart_dev	= "/dev/ttyAMA0";	// GSM board, or a pty of MODEM_EMULATOR given as argument
+FILE *uart_trace		= NULL;
+int  uart_rtscts		= 0;		// -H, RTS/CTS wired to the GSM board
 
-// Program Start
-int main()
+// Program Start: gps_camera [-H] [uart device] [trace file]
+int main(int argc, char *argv[])
 {
+	int opt;
+	while((opt = getopt(argc, argv, "H")) != -1) {
+		if(opt == 'H') uart_rtscts = 1;
+		else {
+			cerr<<"usage: "<<argv[0]<<" [-H] [uart device] [trace file]"<<endl;
+			return 1;
+		}
+	}
+	if(argc > optind) uart_dev = argv[optind];
+	if(argc > optind + 1) trace_open(argv[optind + 1]);
+	
 	if (!bcm2835_init())
 		return 1;
 	
@@ -94,24 +195,125 @@ int main()
 void init_uart()
 {
 	// Open the Port. We want read/write, no "controlling tty" status, and open it no matter what state DCD is in
-    uart0_filestream = open("/dev/ttyAMA0", O_RDWR | O_NOCTTY | O_NDELAY);
-    if (uart0_filestream == -1) 	perror("open_port: Unable to open /dev/ttyAMA0 - ");
+    uart0_filestream = open(uart_dev, O_RDWR | O_NOCTTY | O_NDELAY);
+    if (uart0_filestream == -1) 	perror("open_port: Unable to open uart - ");
+	
+	if(-1 == uart_set_rate(uart_default_rate, 0))	perror("tccsetattr error  !!!! ");
+	rx.head = rx.tail = 0;
+	
+	// Turn off blocking for reads, use (fd, F_SETFL, FNDELAY) if you want that
+    fcntl(uart0_filestream, F_SETFL, 0);
+    
+    int rate = negotiate_baud();
+    if(rate == -1) cout<<"GSM board not answering, UART left at "<<uart_default_rate<<endl;
+    else cout<<"UART at "<<rate<<" baud"<<endl;
+    
+    cout<<"UART successfully Initialized" <<endl;
+}
+
+// Port parameters, rtscts for hardware flow control. What is queued goes out at the old rate first.
+int uart_set_rate(int rate, int rtscts)
+{
+	speed_t baud;
+	switch(rate) {
+	case 460800: baud = B460800; break;
+	case 230400: baud = B230400; break;
+	case 115200: baud = B115200; break;
+	case 57600:  baud = B57600;  break;
+	case 38400:  baud = B38400;  break;
+	case 19200:  baud = B19200;  break;
+	case 9600:   baud = B9600;   break;
+	default:     return -1;
+	}
 	
 		// Set Port Parameters
 	struct termios options;
     tcgetattr(uart0_filestream, &options);
-    options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;		//<Set baud rate
+    options.c_cflag = baud | CS8 | CLOCAL | CREAD | (rtscts ? CRTSCTS : 0);		//<Set baud rate
     options.c_iflag = IGNPAR;
     options.c_oflag = 0;
     options.c_lflag = 0;
     options.c_cc[VMIN] = 1;
+    tcdrain(uart0_filestream);
     tcflush(uart0_filestream, TCIFLUSH);
-	if(-1 == tcsetattr(uart0_filestream, TCSANOW, &options))	perror("tccsetattr error  !!!! ");
+	return tcsetattr(uart0_filestream, TCSANOW, &options);
+}
+
+// Sends cmd, 0 when OK comes within ms, -1 on ERROR or silence
+int uart_probe(const char *cmd, int ms)
+{
+	char buf[128];
+	int  len = 0, n;
+	struct pollfd pfd = {uart0_filestream, POLLIN, 0};
+	
+	snprintf(buf, sizeof(buf), "%s\r", cmd);
+	tcflush(uart0_filestream, TCIFLUSH);
+	if(write(uart0_filestream, buf, strlen(buf)) < 0) return -1;
+	trace_bytes(TRACE_TX, buf, strlen(buf));
+	
+	while(poll(&pfd, 1, ms) > 0) {
+		n = read(uart0_filestream, buf + len, sizeof(buf) - 1 - len);
+		if(n <= 0) return -1;
+		trace_bytes(TRACE_RX, buf + len, n);
+		len += n;
+		buf[len] = 0;
+		if(strstr(buf, "OK")) return 0;
+		if(strstr(buf, "ERROR")) return -1;
+		if(len > 64) {			// keep the tail, a reply may straddle the cut
+			memmove(buf, buf + len - 8, 8);
+			len = 8;
+		}
+	}
+	return -1;
+}
+
+// Finds the rate the GSM board is at, turns on RTS/CTS on both ends when uart_rtscts,
+// then steps the board up with AT+IPR to the fastest of uart_rates both ends manage.
+// A rate the board takes but doesn't answer at is undone, the UART stays at the previous
+// one. Returns the rate in use, -1 if the board is silent.
+int negotiate_baud()
+{
+	const int nrates = sizeof(uart_rates) / sizeof(uart_rates[0]);
+	int  cur = -1, flow = 0, i;
+	char cmd[32];
+	
+	if(0 == uart_probe("AT", 500)) cur = uart_default_rate;
+	for(i = 0; i < nrates && cur == -1; i++)
+		if(0 == uart_set_rate(uart_rates[i], 0) && 0 == uart_probe("AT", 500)) cur = uart_rates[i];
+	if(cur == -1) {
+		uart_set_rate(uart_default_rate, 0);
+		return -1;
+	}
 	
-	// Turn off blocking for reads, use (fd, F_SETFL, FNDELAY) if you want that
-    fcntl(uart0_filestream, F_SETFL, 0);
-    
-    cout<<"UART successfully Initialized" <<endl;
+	// without flow control a faster UART only overruns the board sooner
+	if(uart_rtscts && 0 == uart_probe("AT+IFC=2,2", 500)) {
+		uart_set_rate(cur, 1);
+		if(0 == uart_probe("AT", 500)) flow = 1;
+		else {
+			uart_set_rate(cur, 0);
+			uart_probe("AT+IFC=0,0", 500);
+			cout<<"RTS/CTS not working, flow control off"<<endl;
+		}
+	}
+	if(!flow) return cur;
+	
+	for(i = 0; i < nrates && uart_rates[i] > cur; i++) {
+		snprintf(cmd, sizeof(cmd), "AT+IPR=%d", uart_rates[i]);
+		if(-1 == uart_probe(cmd, 500)) continue;		// not a rate of this board
+		
+		uart_set_rate(uart_rates[i], flow);
+		usleep(100000);
+		if(0 == uart_probe("AT", 500) || 0 == uart_probe("AT", 500)) return uart_rates[i];
+		
+		// back to the previous rate: ask for it at the new one, listen at the old one
+		snprintf(cmd, sizeof(cmd), "AT+IPR=%d\r", cur);
+		if(write(uart0_filestream, cmd, strlen(cmd)) < 0) perror("Write Error");
+		else trace_bytes(TRACE_TX, cmd, strlen(cmd));
+		uart_set_rate(cur, flow);
+		usleep(100000);
+		if(-1 == uart_probe("AT", 500)) cout<<"GSM board lost at "<<uart_rates[i]<<" baud"<<endl;
+	}
+	return cur;
 }
 
 void init_state()
@@ -122,41 +324,26 @@ void init_state()
 
 void send_sms()
 {
-	//AT
-	strcpy(uart_str,"AT");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK	
-	uart_read_until(OK);
-	
 	//AT+CMGF=1
-	strcpy(uart_str,"AT+CMGF=1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK	
-	uart_read_until(OK); 
+	run_script(sms_setup_script, sizeof(sms_setup_script) / sizeof(sms_setup_script[0]));
 		
 	//AT+CMGS=""
-	strcpy(uart_str,"AT+CMGS=\"XXXXXXXXXX\"");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
+	strcpy(uart_write_str,"AT+CMGS=\"XXXXXXXXXX\"");
+	strcat(uart_write_str,at_D);
+	cout << uart_write_str << endl;
 	uart_write();
 	
 	//OK
-	uart_read(MSG);
+	uart_read_until(MSG);
 		
 	//MSG GPS Coordinates
-	strcpy(uart_str,gps_str);
-	cout << uart_str << endl;
-	strcat(uart_str,at_A);
+	strcpy(uart_write_str,gps_str);
+	cout << uart_write_str << endl;
+	strcat(uart_write_str,at_A);
 	uart_write();
 		
     //OK
-    uart_read(OK);
+    uart_read_until(OK);
 	
     cout<<"message sent"<<endl;
 }
@@ -164,30 +351,150 @@ void send_sms()
 // Serial write
 void uart_write()
 {
-    int n = write(uart0_filestream, uart_str, strlen(uart_str));
+    int n = write(uart0_filestream, uart_write_str, strlen(uart_write_str));
     if (n < 0)  perror("Write Error");
+    else trace_bytes(TRACE_TX, uart_write_str, n);
 }
 
-// serial read
-void uart_read_until(const char *p_label)
+// Appends to the trace file at path, a trace that can't be written is only reported
+void trace_open(const char *path)
 {
-	int  n=-1,i=0;
-	char tmp=0;
-	
-	for(i=0;i<256;i++) uart_read_str[i]=0;
+	uart_trace = fopen(path, "ab");
+	if(uart_trace) fseek(uart_trace, 0, SEEK_END);
+	if(!uart_trace || (0 == ftell(uart_trace) && 1 != fwrite(trace_magic, sizeof(trace_magic) - 1, 1, uart_trace))) {
+		perror("trace open error");
+		if(uart_trace) fclose(uart_trace);
+		uart_trace = NULL;
+	}
+}
+
+// One read or write of the UART into the trace, flushed right away: the trace is for the
+// problems that end with a crash or a power cut
+void trace_bytes(int dir, const void *p, size_t n)
+{
+	const char *b = (const char *)p;
+	struct timespec t;
+	
+	if(!uart_trace) return;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	while(n) {
+		trace_rec r;
+		r.ms = t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+		r.len = n < UINT16_MAX ? n : UINT16_MAX;
+		r.dir = dir;
+		r.spare = 0;
+		fwrite(&r, sizeof(r), 1, uart_trace);
+		fwrite(b, r.len, 1, uart_trace);
+		b += r.len;
+		n -= r.len;
+	}
+	fflush(uart_trace);
+}
+
+// Automaton of the response tokens: a trie of the tokens with every missing transition
+// filled in from the failure link, one table lookup per byte
+reply_matcher build_reply_matcher()
+{
+	reply_matcher m;
+	vector<int> fail(1, 0);
+	deque<int> bfs;
+	int t, c, st;
+	
+	m.next.push_back(vector<short>(256, -1));
+	m.out.push_back(0);
+	for(t = 0; t < TOK_COUNT; t++) {
+		st = 0;
+		for(const char *p = reply_tokens[t]; *p; p++) {
+			c = (unsigned char)*p;
+			if(m.next[st][c] == -1) {
+				m.next[st][c] = m.next.size();
+				m.next.push_back(vector<short>(256, -1));
+				m.out.push_back(0);
+				fail.push_back(0);
+			}
+			st = m.next[st][c];
+		}
+		m.out[st] |= 1u << t;
+	}
 	
-	i=0;
-	while(1) {
-		n = read(uart0_filestream, &tmp, 1);
-		if (n < 0)  perror("Read Error");
-		uart_read_str[i++] = tmp;
-		if(NULL != strstr(uart_read_str,"ERROR"))    perror("Response ERROR");
-		if(NULL != strstr(uart_read_str,ptr_l))		 break;
+	// breadth first, a state's failure link is always done before the state
+	for(c = 0; c < 256; c++) {
+		if(m.next[0][c] == -1) m.next[0][c] = 0;
+		else bfs.push_back(m.next[0][c]);
+	}
+	while(!bfs.empty()) {
+		st = bfs.front();
+		bfs.pop_front();
+		m.out[st] |= m.out[fail[st]];
+		for(c = 0; c < 256; c++) {
+			int to = m.next[st][c];
+			if(to == -1) m.next[st][c] = m.next[fail[st]][c];
+			else {
+				fail[to] = m.next[fail[st]][c];
+				bfs.push_back(to);
+			}
+		}
+	}
+	return m;
+}
+
+// next byte from the GSM board, -1 on a read error. A read takes all the board has sent,
+// up to the free space of the ring.
+int uart_getc()
+{
+	if(rx.head == rx.tail) {
+		unsigned pos = rx.tail % uart_ring_size;
+		int n;
+		do n = read(uart0_filestream, rx.buf + pos, uart_ring_size - pos);
+		while(n < 0 && errno == EINTR);
+		if(n <= 0) { perror("Read Error"); return -1; }
+		trace_bytes(TRACE_RX, rx.buf + pos, n);
+		rx.tail += n;
+	}
+	return rx.buf[rx.head++ % uart_ring_size];
+}
+
+// serial read, until p_label. uart_read_str keeps the latest bytes of the response
+void uart_read_until(const char *p_label)
+{
+	static const reply_matcher m = build_reply_matcher();
+	int  want = -1, st = 0, c, i;
+	int  len = 0;
+	
+	for(i = 0; i < TOK_COUNT; i++)
+		if(0 == strcmp(reply_tokens[i], p_label)) want = i;
+	if(want == -1) { cout<<"Unknown response "<<p_label<<endl; return; }
+	
+	memset(uart_read_str, 0, sizeof(uart_read_str));
+	while(-1 != (c = uart_getc())) {
+		// full: drop the older half, the tail is what the callers look at
+		if(len == (int)sizeof(uart_read_str) - 1) {
+			len = sizeof(uart_read_str) / 2;
+			memmove(uart_read_str, uart_read_str + sizeof(uart_read_str) - 1 - len, len);
+		}
+		uart_read_str[len++] = c;
+		uart_read_str[len]   = 0;
+		
+		st = m.next[st][c];
+		if(m.out[st] & (1u << TOK_ERROR))	perror("Response ERROR");
+		if(m.out[st] & (1u << want))		break;
 	}
 	
 	cout<<p_label<<endl;
 }
 
+// Runs an AT script, a round trip per step
+void run_script(const at_step *steps, size_t n)
+{
+	for(size_t i = 0; i < n; i++) {
+		cout << steps[i].frame << endl;
+		int w = write(uart0_filestream, steps[i].frame, steps[i].len);
+		if(w < 0) perror("Write Error");
+		else trace_bytes(TRACE_TX, steps[i].frame, w);
+		for(int t = 0; t < steps[i].times; t++) uart_read_until(steps[i].until);
+	}
+}
+
 int read_sms()
 {
 	uart_read_until("MSGOVER");
@@ -203,7 +510,7 @@ int read_sms()
 			if(sys_state == SYS_STOP)	init_state();
 		} 
 	}
-		
+	return 0;
 }
 
 int stop_state()
@@ -219,196 +526,64 @@ int stop_state()
 	
 	//set system state
 	sys_state = SYS_STOP;
-	
+	return 0;
 }
 
 int take_picture()
 {
-	if(-1 == system("fswebcam image.jpeg") return -1;
+	if(0 != system("fswebcam image.jpeg")) return -1;
 	else return 0;
 }
 
 void init_gps()
 {
-	// AT
-	strcpy(uart_str,"AT");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CGPSPWR=1
-	strcpy(uart_str,"AT+CGPSPWR=1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CGPSRST=1
-	strcpy(uart_str,"AT+CGPSRST=1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CFUN=1
-	strcpy(uart_str,"AT+CFUN=1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CIPSHUT
-	strcpy(uart_str,"AT+CIPSHUT");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CIPSTATUS
-	strcpy(uart_str,"AT+CIPSTATUS");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(ST_IP_INITIAL);
-	
-	// AT+CGDCONT=1,"IP",
-	strcpy(uart_str,"AT+CGDCONT=1,\"IP\",");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CGACT=1,1
-	strcpy(uart_str,"AT+CGACT=1,1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CGATT=1
-	strcpy(uart_str,"AT+CGATT=1");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CIPSTATUS
-	strcpy(uart_str,"AT+CIPSTATUS");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(ST_IP_INITIAL);
-	
-	// AT+CGATT=1
-	strcpy(uart_str,"AT+CSTT");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CGATT=1
-	strcpy(uart_str,"AT+CIPSTATUS");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(ST_IP_START);
-	
-	// AT+CIICR
-	strcpy(uart_str,"AT+CIICR");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
-	
-	// AT+CIFSR
-	strcpy(uart_str,"AT+CIFSR");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(DOT);
-	uart_read_until(DOT);
-	uart_read_until(DOT);
-	
-	//AT+CGPSINF=32
-	strcpy(uart_str,"AT+CGPSINF=32");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
+	run_script(gps_init_script, sizeof(gps_init_script) / sizeof(gps_init_script[0]));
 	
 	//process uart_read_str for coordinates
 	if(0 == process_gps_coordinates()) {cout<<"GPS successfully initialized" <<endl;}
-	else {cout<<"GPS coordinates NOT SET !!!!"};
+	else {cout<<"GPS coordinates NOT SET !!!!"<<endl;}
 }
 
 void get_gps_coordinates()
 {
 	//AT+CGPSINF=32
-	strcpy(uart_str,"AT+CGPSINF=32");
-	strcat(uart_str,at_D);
-	cout << uart_str << endl;
-	uart_write();
-	
-	//OK
-	uart_read_until(OK);
+	run_script(gps_read_script, sizeof(gps_read_script) / sizeof(gps_read_script[0]));
 }
 
+// "<label> <value> <hemisphere> " into gps_str at *j, from the field of uart_read_str at *i.
+// -1 when the field is empty or all zeros (no fix), runs past the end of the response or
+// doesn't fit in gps_str.
+static int copy_coordinate(const char *label, int *i, int *j)
+{
+	const char *p   = uart_read_str + *i;
+	const char *end = strchr(p, ',');
+	
+	if(!end || end == p || strspn(p, "0.") >= (size_t)(end - p)) return -1;
+	const char *hemi = end + 1, *hemi_end = strchr(hemi, ',');
+	if(!hemi_end) return -1;
+	
+	int n = snprintf(gps_str + *j, sizeof(gps_str) - *j, "%s %.*s %.*s ", label,
+	                 (int)(end - p), p, (int)(hemi_end - hemi), hemi);
+	if(n < 0 || *j + n >= (int)sizeof(gps_str)) return -1;
+	*j += n;
+	*i = hemi_end + 1 - uart_read_str;
+	return 0;
+}
+
+// +CGPSINF: 32,<time>,A,<lat>,N,<long>,E,.. : status A is a valid fix. gps_str gets
+// "LATITUDE <lat> N LONGITUDE <long> E", empty and -1 without a fix.
 int process_gps_coordinates()
 {
-	int i=0,j=0;
-	
-	while( (uart_read_str[i] != 'A') || (uart_read_str[i+1] != ',') || (uart_read_str[i-1] != ',') ) i++;
-	i++;
-	
-	gps_str[j++] = 'L'; gps_str[j++] = 'A'; gps_str[j++] = 'T'; gps_str[j++] = 'I'; 
-	gps_str[j++] = 'T'; gps_str[j++] = 'U'; gps_str[j++] = 'D'; gps_str[j++] = 'E'; 
-	gps_str[j++] = ' ';
-	
-	while(uart_read_str[i] != ',') { 
-		if(uart_read_str[i] == '0' && uart_read_str[i+1] == '0' && uart_read_str[i+2] =='0' && uart_read_str[i+3] == '0') return -1;
-		else gps_str[j++] = uart_read_str[i++];
+	const char *fix = strstr(uart_read_str, ",A,");
+	int i, j = 0;
+	
+	gps_str[0] = 0;
+	if(!fix) return -1;
+	i = fix + 3 - uart_read_str;
+	if(-1 == copy_coordinate("LATITUDE", &i, &j) || -1 == copy_coordinate("LONGITUDE", &i, &j)) {
+		gps_str[0] = 0;
+		return -1;
 	}
-	
-	i+=2;
-	
-	gps_str[j++] = 'L'; gps_str[j++] = 'O'; gps_str[j++] = 'N'; gps_str[j++] = 'G'; 
-	gps_str[j++] = 'I'; gps_str[j++] = 'T'; gps_str[j++] = 'U'; gps_str[j++] = 'D'; gps_str[j++] = 'E'; 
-	gps_str[j++] = ' ';
-	
-	while(uart_read_str[i] != ',') {
-		if(uart_read_str[i] == '0' && uart_read_str[i+1] == '0' && uart_read_str[i+2] =='0' && uart_read_str[i+3] == '0') return -1;
-		else gps_str[j++] = uart_read_str[i++]; }
-	
+	gps_str[j - 1] = 0;		// the last space
 	return 0;
 }
@@ -0,0 +1,258 @@
+/* Fuzz and speed check of the GSM board response parsers of gps_camera.cpp:
+- uart_read_until(): the reply automaton, fed from a pipe in place of the UART
+- process_gps_coordinates(): the CGPSINF fix into gps_str
+
+Inputs are mutated from a corpus: the built in responses below, plus files or serial traces
+(gps_camera's second argument, MODEM_EMULATOR -R) given on the command line. Each input is
+checked against a plain reference: the automaton must stop exactly where a memmem() search
+finds the token, and the coordinates must be what splitting the fields gives. A failing
+input is printed and saved to parser_fuzz.fail.
+
+	g++ -std=c++11 -O1 -g -fsanitize=address,undefined -o parser_fuzz parser_fuzz.cpp -lbcm2835
+	./parser_fuzz [-n runs] [-s seed] [corpus ..]	fuzz, 100000 runs by default
+	./parser_fuzz -b [corpus ..]					bytes/s of each parser
+
+With libFuzzer instead of the built in mutator:
+
+	clang++ -std=c++11 -DLIBFUZZER -g -fsanitize=fuzzer,address -o parser_fuzz parser_fuzz.cpp -lbcm2835
+	./parser_fuzz -close_fd_mask=3 corpus_dir
+*/
+
+#define main gps_camera_main
+#include "../gps_camera.cpp"
+#undef main
+
+#include <string>
+#include <fstream>
+
+// checks
+int  check_input(const unsigned char *, size_t);
+int  read_until_consumed(const string &, const char *);
+string reference_gps(const string &);
+
+// corpus and mutator
+int  load_corpus(const char *, vector<string> *);
+string mutate(const string &);
+
+// global constants
+const size_t fuzz_max_input = 4096;		// well inside a pipe's buffer
+const char *seed_inputs[] = {
+	"AT\r\r\nOK\r\n",
+	"\r\nERROR\r\n",
+	"AT+CMGS=\"XXXXXXXXXX\"\r\r\n> ",
+	"\r\n+CMT: \"+91XXXXXXXXXX\",,\"16/04/02,10:11:12+22\"\r\nXXXXXXXXXX STOP MSGOVER\r\n",
+	"AT+CIPSTATUS\r\r\nOK\r\n\r\nSTATE: IP INITIAL\r\n",
+	"AT+CIPSTATUS\r\r\nOK\r\n\r\nSTATE: IP START\r\n",
+	"AT+CIFSR\r\r\n10.64.2.17\r\n",
+	"AT+CGPSINF=32\r\r\n32,103512.000,A,1258.8561,N,07735.6521,E,0.00,0.00,020416,,E,A\r\nOK\r\n",
+	"AT+CGPSINF=32\r\r\n32,000000.000,V,0000.0000,N,00000.0000,E,0.00,0.00,000000,,N,N\r\nOK\r\n",
+	"32,103512.000,A,,N,07735.6521,E,0.00\r\n",
+	"32,103512.000,A,1258.8561,N,07735.6521",
+};
+const char *fuzz_tokens[] = {",A,", ",", "OK", "ERROR", ">", "MSGOVER", "\r\n", "0000", ".", "STATE: IP INITIAL", "STATE: IP START"};
+
+// global variables
+FILE *report = stdout;
+
+// Bytes consumed by uart_read_until(label) over input, read from a pipe as from the UART
+int read_until_consumed(const string &input, const char *label)
+{
+	int fds[2];
+	
+	if(-1 == pipe(fds)) { perror("pipe"); exit(2); }
+	if(write(fds[1], input.data(), input.size()) != (ssize_t)input.size()) { perror("pipe write"); exit(2); }
+	close(fds[1]);
+	uart0_filestream = fds[0];
+	rx.head = rx.tail = 0;
+	uart_read_until(label);
+	close(fds[0]);
+	uart0_filestream = -1;
+	return rx.head;
+}
+
+// What process_gps_coordinates() should make of response: the fields after ",A,", or ""
+string reference_gps(const string &response)
+{
+	size_t at = response.find(",A,");
+	vector<string> f;
+	
+	if(at == string::npos) return "";
+	for(size_t p = at + 3; f.size() < 4; ) {
+		size_t comma = response.find(',', p);
+		if(comma == string::npos) return "";
+		f.push_back(response.substr(p, comma - p));
+		p = comma + 1;
+	}
+	for(int k = 0; k < 4; k += 2)
+		if(f[k].empty() || f[k].find_first_not_of("0.") == string::npos) return "";
+	string out = "LATITUDE " + f[0] + " " + f[1] + " LONGITUDE " + f[2] + " " + f[3];
+	return out.size() < sizeof(gps_str) - 1 ? out : "";
+}
+
+// 0 when both parsers agree with the reference on input, -1 (reported) otherwise
+int check_input(const unsigned char *data, size_t size)
+{
+	string input((const char *)data, min(size, fuzz_max_input));
+	
+	for(int t = 0; t < TOK_COUNT; t++) {
+		size_t found = input.find(reply_tokens[t]);
+		int want = (found == string::npos) ? input.size() : found + strlen(reply_tokens[t]);
+		int got  = read_until_consumed(input, reply_tokens[t]);
+		if(got != want) {
+			fprintf(report, "uart_read_until(\"%s\") stopped after %d bytes, not %d\n", reply_tokens[t], got, want);
+			return -1;
+		}
+	}
+	
+	// the response as uart_read_until() leaves it: the tail, up to the first NUL
+	string tail = input.substr(input.size() > sizeof(uart_read_str) - 1 ? input.size() - (sizeof(uart_read_str) - 1) : 0);
+	tail = tail.substr(0, tail.find('\0'));
+	memset(uart_read_str, 0, sizeof(uart_read_str));
+	memcpy(uart_read_str, tail.data(), tail.size());
+	memset(gps_str, 'x', sizeof(gps_str));
+	
+	int ret = process_gps_coordinates();
+	string want = reference_gps(tail);
+	if(!memchr(gps_str, 0, sizeof(gps_str)) || (ret == 0) != !want.empty() || want != gps_str) {
+		fprintf(report, "process_gps_coordinates() returned %d \"%.*s\", not \"%s\"\n", ret,
+		        (int)sizeof(gps_str), gps_str, want.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// The board's side of a serial trace, or the whole file, cut to inputs
+int load_corpus(const char *path, vector<string> *corpus)
+{
+	FILE *f = fopen(path, "rb");
+	string data, in;
+	char buf[4096];
+	size_t n;
+	
+	if(!f) { perror(path); return -1; }
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+	fclose(f);
+	
+	if(0 == data.compare(0, sizeof(trace_magic) - 1, trace_magic)) {
+		for(size_t pos = sizeof(trace_magic) - 1; pos + sizeof(trace_rec) <= data.size(); ) {
+			trace_rec r;
+			memcpy(&r, data.data() + pos, sizeof(r));
+			pos += sizeof(r);
+			if(pos + r.len > data.size()) break;
+			if(r.dir == TRACE_RX) in.append(data, pos, r.len);
+			pos += r.len;
+		}
+	}
+	else in = data;
+	for(size_t pos = 0; pos < in.size(); pos += fuzz_max_input) corpus->push_back(in.substr(pos, fuzz_max_input));
+	return 0;
+}
+
+// A few random edits: bytes flipped, inserted or dropped, tokens inserted, ranges repeated
+string mutate(const string &in)
+{
+	string s = in;
+	int edits = 1 + rand() % 8;
+	
+	while(edits--) {
+		size_t at = s.empty() ? 0 : rand() % (s.size() + 1);
+		switch(rand() % 5) {
+		case 0: if(at < s.size()) s[at] ^= 1 << (rand() % 8); break;
+		case 1: s.insert(at, 1, (char)(rand() % 256)); break;
+		case 2: s.erase(at, rand() % 16); break;
+		case 3: s.insert(at, fuzz_tokens[rand() % (sizeof(fuzz_tokens) / sizeof(fuzz_tokens[0]))]); break;
+		case 4: s.insert(at, s.substr(rand() % (s.size() + 1), rand() % 64)); break;
+		}
+	}
+	return s.substr(0, fuzz_max_input);
+}
+
+#ifdef LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if(-1 == check_input(data, size)) abort();
+	return 0;
+}
+#else
+static double seconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	long runs = 100000;
+	unsigned seed = time(NULL);
+	int bench = 0, opt;
+	vector<string> corpus;
+	
+	while((opt = getopt(argc, argv, "n:s:b")) != -1) {
+		switch(opt) {
+		case 'n': runs = atol(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		case 'b': bench = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-n runs] [-s seed] [-b] [corpus ..]\n", argv[0]);
+			return 2;
+		}
+	}
+	for(size_t i = 0; i < sizeof(seed_inputs) / sizeof(seed_inputs[0]); i++) corpus.push_back(seed_inputs[i]);
+	for(int i = optind; i < argc; i++) if(-1 == load_corpus(argv[i], &corpus)) return 2;
+	
+	// gps_camera talks through cout and perror() on every response. Those streams go nowhere,
+	// the driver writes to stdout and the sanitizers still to fd 2.
+	static ofstream null_out("/dev/null");
+	cout.rdbuf(null_out.rdbuf());
+	stderr = fopen("/dev/null", "w");
+	setvbuf(report, NULL, _IOLBF, 0);
+	
+	if(bench) {
+		static const reply_matcher m = build_reply_matcher();
+		size_t bytes = 0;
+		for(size_t i = 0; i < corpus.size(); i++) bytes += corpus[i].size();
+		int reps = max(1, (int)(4000000 / max(bytes, (size_t)1)));
+	
+		double t = seconds();
+		unsigned hits = 0;
+		for(int r = 0; r < reps; r++)
+			for(size_t i = 0; i < corpus.size(); i++) {
+				int st = 0;
+				for(size_t k = 0; k < corpus[i].size(); k++) hits += m.out[st = m.next[st][(unsigned char)corpus[i][k]]];
+			}
+		fprintf(report, "reply automaton          %10.1f MB/s (%u)\n", reps * bytes / (seconds() - t) / 1e6, hits & 1);
+	
+		t = seconds();
+		for(int r = 0; r < reps / 20 + 1; r++)
+			for(size_t i = 0; i < corpus.size(); i++) read_until_consumed(corpus[i], "MSGOVER");
+		fprintf(report, "uart_read_until          %10.1f MB/s, pipe included\n", (reps / 20 + 1) * bytes / (seconds() - t) / 1e6);
+	
+		t = seconds();
+		long calls = 0;
+		for(int r = 0; r < reps; r++)
+			for(size_t i = 0; i < corpus.size(); i++, calls++) {
+				size_t n = min(corpus[i].size(), sizeof(uart_read_str) - 1);
+				memcpy(uart_read_str, corpus[i].data(), n);
+				uart_read_str[n] = 0;
+				process_gps_coordinates();
+			}
+		fprintf(report, "process_gps_coordinates  %10.0f calls/s\n", calls / (seconds() - t));
+		return 0;
+	}
+	
+	srand(seed);
+	fprintf(report, "%ld runs, seed %u, %zu corpus inputs\n", runs, seed, corpus.size());
+	for(long r = 0; r < runs; r++) {
+		string in = (r < (long)corpus.size()) ? corpus[r] : mutate(corpus[rand() % corpus.size()]);
+		if(0 == check_input((const unsigned char *)in.data(), in.size())) continue;
+	
+		fprintf(report, "run %ld failed, input saved to parser_fuzz.fail\n", r);
+		FILE *f = fopen("parser_fuzz.fail", "wb");
+		if(f) { fwrite(in.data(), 1, in.size(), f); fclose(f); }
+		return 1;
+	}
+	fprintf(report, "all passed\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,967 @@
+/* GSM modem emulator: a pseudo-terminal that answers the AT commands of FTP_DICOM and GPS_CAMERA
+the way the SIM800 / SIM908 boards do, so the programs can run and be timed without a modem and a SIM.
+The network side is shaped: round trip latency, jitter, uplink bandwidth, failed network
+operations, lost replies and late FTPPUT grants. The UART side runs at the rate the host set on the port.
+Every upload that goes through it is reported: bytes, bytes/s, round trips and time per phase,
+with a summary by upload size when it is stopped (Ctrl-C).
+
+	modem_emulator -l /tmp/ttyGSM0 &
+	dcm_2_jpg_ftp -m /tmp/ttyGSM0
+	gps_camera /tmp/ttyGSM0
+
+It also plays back serial traces recorded in the field (dcm_2_jpg_ftp -T, the second
+argument of gps_camera): the modem's side of the trace goes to the host at the recorded
+pace, or faster, and what the host sends is checked against the host's side.
+
+	modem_emulator -R field.ttyAMA0 -x 10 &
+	dcm_2_jpg_ftp -m /tmp/ttyGSM0
+*/
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+using namespace std;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <pty.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// network side of the emulated link
+struct link_shape {
+	double rtt;			// seconds, round trip of an operation that goes out to the network
+	double jitter;		// seconds, +- uniformly on every round trip
+	double rate;		// uplink bytes/s
+	double error;		// percent of network operations that fail
+	double drop;		// percent of replies that never come
+	double late;		// percent of FTPPUT chunk grants held back to the next FTPPUT, after the OK of a close
+};
+
+// what a command did, the dispatcher sends the final result code
+enum { ST_OK, ST_ERROR, ST_DONE };
+
+// where the time of an upload goes
+enum { PH_SETUP, PH_OPEN, PH_DATA, PH_CLOSE, PH_OTHER, PH_COUNT };
+
+struct upload_stats {
+	bool   active;
+	string name;
+	size_t bytes;
+	double start;
+	double phase[PH_COUNT];
+	long   round_trips;
+};
+
+// summary by upload size
+struct size_bucket {
+	const char *label;
+	size_t below;
+	long   files;
+	size_t bytes;
+	double seconds;
+	long   round_trips;
+};
+
+// serial trace record as the programs write it, followed by len bytes
+struct trace_rec {
+	uint32_t ms;		// CLOCK_MONOTONIC, only the difference between records counts
+	uint16_t len;
+	uint8_t  dir;		// TRACE_RX modem -> host, TRACE_TX host -> modem
+	uint8_t  spare;
+};
+enum { TRACE_RX, TRACE_TX };
+
+// an AT command: name as sent (+FTPPUT), handler and phase of the upload it belongs to
+struct at_handler {
+	const char *name;
+	int (*run)(const string &);
+	int phase;
+};
+
+// emulated link
+double now();
+void   pace(size_t);
+void   emit(const string &);
+void   reply(const string &);
+void   net_wait(double);
+bool   net_fails();
+int    read_data(size_t, string *);
+void   send_grant(bool);
+
+// commands
+int at_ok(const string &);
+int at_echo(const string &);
+int at_csq(const string &);
+int at_sms(const string &);
+int at_sapbr(const string &);
+int at_ftp_param(const string &);
+int at_ftpputname(const string &);
+int at_ftpgetname(const string &);
+int at_ftpputopt(const string &);
+int at_ftpput(const string &);
+int at_ftpsize(const string &);
+int at_cipshut(const string &);
+int at_cstt(const string &);
+int at_ciicr(const string &);
+int at_cifsr(const string &);
+int at_cipstart(const string &);
+int at_cipstatus(const string &);
+int at_httppara(const string &);
+int at_httpdata(const string &);
+int at_httpaction(const string &);
+int at_attach(const string &);
+int at_cgpsinf(const string &);
+
+void run_line(const string &);
+void upload_done();
+void print_summary();
+
+// serial traces
+int    load_trace(const char *, string *);
+string printable(const char *, size_t);
+int    dump_trace(const char *);
+int    replay_trace(const char *, double);
+
+// global constants
+const at_handler handlers[] = {
+	{ "",            at_ok,         PH_OTHER },
+	{ "E",           at_echo,       PH_OTHER },
+	{ "+IPR",        at_ok,         PH_OTHER },
+	{ "+IFC",        at_ok,         PH_OTHER },
+	{ "+CSQ",        at_csq,        PH_OTHER },
+	{ "+CMGF",       at_ok,         PH_OTHER },
+	{ "+CMGS",       at_sms,        PH_OTHER },
+	{ "+CMGSEX",     at_sms,        PH_OTHER },
+	{ "+SAPBR",      at_sapbr,      PH_SETUP },
+	{ "+FTPCID",     at_ftp_param,  PH_SETUP },
+	{ "+FTPSERV",    at_ftp_param,  PH_SETUP },
+	{ "+FTPUN",      at_ftp_param,  PH_SETUP },
+	{ "+FTPPW",      at_ftp_param,  PH_SETUP },
+	{ "+FTPPUTPATH", at_ftp_param,  PH_SETUP },
+	{ "+FTPGETPATH", at_ftp_param,  PH_SETUP },
+	{ "+FTPPUTNAME", at_ftpputname, PH_OPEN },
+	{ "+FTPGETNAME", at_ftpgetname, PH_OPEN },
+	{ "+FTPPUTOPT",  at_ftpputopt,  PH_OPEN },
+	{ "+FTPPUT",     at_ftpput,     PH_DATA },		// =1 is open, =2,0 is close
+	{ "+FTPSIZE",    at_ftpsize,    PH_OPEN },
+	{ "+CIPSHUT",    at_cipshut,    PH_SETUP },
+	{ "+CIPMODE",    at_ok,         PH_SETUP },
+	{ "+CSTT",       at_cstt,       PH_SETUP },
+	{ "+CIICR",      at_ciicr,      PH_SETUP },
+	{ "+CIFSR",      at_cifsr,      PH_SETUP },
+	{ "+CIPSTART",   at_cipstart,   PH_DATA },
+	{ "+CIPSTATUS",  at_cipstatus,  PH_SETUP },
+	{ "+HTTPTERM",   at_ok,         PH_SETUP },
+	{ "+HTTPINIT",   at_ok,         PH_SETUP },
+	{ "+HTTPPARA",   at_httppara,   PH_OPEN },
+	{ "+HTTPDATA",   at_httpdata,   PH_DATA },
+	{ "+HTTPACTION", at_httpaction, PH_CLOSE },
+	{ "+CGPSPWR",    at_ok,         PH_OTHER },
+	{ "+CGPSRST",    at_ok,         PH_OTHER },
+	{ "+CFUN",       at_ok,         PH_OTHER },
+	{ "+CGDCONT",    at_ok,         PH_SETUP },
+	{ "+CGACT",      at_attach,     PH_SETUP },
+	{ "+CGATT",      at_attach,     PH_SETUP },
+	{ "+CGPSINF",    at_cgpsinf,    PH_OTHER },
+};
+
+const char *phase_names[PH_COUNT] = {"setup", "open", "data", "close", "other"};
+const char *ip_address = "10.64.2.17";
+const int  ftp_max_len = 1360;			// +FTPPUT: 1,1,<max>
+const int  data_timeout = 120;			// seconds the host gets for data it announced
+const char trace_magic[] = "ATTRACE1";
+
+// global variables
+int        master = -1;
+link_shape shape = {0.6, 0.2, 5000, 0, 0, 0};	// GPRS class 10, a few KB/s up
+int        echo = 1;
+const char *keep_dir = NULL;			// uploaded files go there when set
+volatile sig_atomic_t stop = 0;
+
+// modem state
+int    bearer = 0;
+string ip_state = "IP INITIAL";
+string put_name, get_name;
+int    put_appe = 0;
+int    ftp_session = 0;
+double net_free = 0;			// when the modem's send buffer is empty again
+double grant_at = 0;			// +FTPPUT: 1,1,<max> of the last chunk due then, 0 for none ..
+bool   grant_late = false;		// .. or held back to the next FTPPUT
+map<string, string> server;		// what the emulated server holds, by name
+string http_name, http_body;
+long   sms_ref = 0;
+
+upload_stats cur;
+size_bucket buckets[] = {
+	{ "< 16 KB",  16 * 1024,   0, 0, 0, 0 },
+	{ "< 64 KB",  64 * 1024,   0, 0, 0, 0 },
+	{ "< 256 KB", 256 * 1024,  0, 0, 0, 0 },
+	{ ">= 256 KB", (size_t)-1, 0, 0, 0, 0 },
+};
+int    cur_phase = PH_OTHER;
+double phase_since = 0;
+
+static void on_stop(int)
+{
+	stop = 1;
+}
+
+// modem_emulator [-l link] [-r rtt_ms] [-j jitter_ms] [-b bytes/s] [-e error%] [-d drop%] [-g late%] [-o dir] [-s seed]
+// modem_emulator [-l link] -R trace [-x speed]
+// modem_emulator -T trace
+//   -l <path>   symlink to the pty, for the programs to open (default /tmp/ttyGSM0)
+//   -r <ms>     network round trip (default 600)
+//   -j <ms>     jitter, +- on every round trip (default 200)
+//   -b <B/s>    uplink bandwidth (default 5000)
+//   -e <pct>    network operations that fail: FTP errors, CONNECT FAIL, HTTP 601, CMS ERROR
+//   -d <pct>    replies that are lost, the host has to time out
+//   -g <pct>    FTPPUT chunk grants (+FTPPUT: 1,1,<max>) held back to the next FTPPUT, so the
+//               last one comes after the OK of AT+FTPPUT=2,0
+//   -o <dir>    keep the uploaded files
+//   -s <seed>   for the error and drop draws
+//   -R <trace>  play a serial trace back instead of emulating
+//   -x <speed>  times faster than recorded, 0 for no waits (default 1)
+//   -T <trace>  print a serial trace as text
+int main(int argc, char *argv[])
+{
+	const char *link = "/tmp/ttyGSM0";
+	const char *replay = NULL;
+	double speed = 1;
+	unsigned seed = time(NULL);
+	int opt, slave;
+	char name[64];
+	
+	while((opt = getopt(argc, argv, "l:r:j:b:e:d:g:o:s:R:x:T:")) != -1) {
+		switch(opt) {
+		case 'l': link = optarg; break;
+		case 'r': shape.rtt = atof(optarg) / 1000; break;
+		case 'j': shape.jitter = atof(optarg) / 1000; break;
+		case 'b': shape.rate = atof(optarg); break;
+		case 'e': shape.error = atof(optarg); break;
+		case 'd': shape.drop = atof(optarg); break;
+		case 'g': shape.late = atof(optarg); break;
+		case 'o': keep_dir = optarg; break;
+		case 's': seed = atoi(optarg); break;
+		case 'R': replay = optarg; break;
+		case 'x': speed = atof(optarg); break;
+		case 'T': return dump_trace(optarg) == -1;
+		default:
+			cerr << "usage: " << argv[0] << " [-l link] [-r rtt_ms] [-j jitter_ms] [-b bytes/s] [-e error%] [-d drop%] [-g late%] [-o dir] [-s seed] [-R trace [-x speed]] [-T trace]" << endl;
+			return 1;
+		}
+	}
+	if(shape.rate <= 0) shape.rate = 1;
+	srand(seed);
+	
+	// raw on both ends, the host sets its own rate on the slave
+	struct termios raw;
+	memset(&raw, 0, sizeof(raw));
+	cfmakeraw(&raw);
+	cfsetspeed(&raw, B115200);
+	if(-1 == openpty(&master, &slave, name, &raw, NULL)) {
+		perror("openpty error  !!!! ");
+		return 1;
+	}
+	unlink(link);
+	if(-1 == symlink(name, link)) {
+		perror("symlink error  !!!! ");
+		return 1;
+	}
+	signal(SIGINT, on_stop);
+	signal(SIGTERM, on_stop);
+	
+	if(replay) {
+		cout << "Playing " << replay << " back on " << name << " (" << link << ")" << endl;
+		int ret = replay_trace(replay, speed);
+		unlink(link);
+		close(slave);
+		close(master);
+		return ret != 0;
+	}
+	cout << "Modem on " << name << " (" << link << "), rtt " << shape.rtt * 1000 << " ms +- " << shape.jitter * 1000
+	     << ", " << shape.rate << " bytes/s, " << shape.error << "% errors, " << shape.drop << "% lost replies, "
+	     << shape.late << "% late FTPPUT grants" << endl;
+	
+	// the slave stays open here too, so the master doesn't see a hangup between host runs
+	string line;
+	while(!stop) {
+		struct pollfd pfd = {master, POLLIN, 0};
+		char buf[256];
+		int wait = 500;
+	
+		send_grant(false);
+		if(grant_at > 0 && !grant_late) wait = max(0, min(wait, (int)((grant_at - now()) * 1000) + 1));
+		if(poll(&pfd, 1, wait) <= 0) continue;
+		ssize_t n = read(master, buf, sizeof(buf));
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR) continue;
+			usleep(100000);
+			continue;
+		}
+		pace(n);
+		for(ssize_t i = 0; i < n; i++) {
+			char c = buf[i];
+			if(echo) emit(string(1, c));
+			if(c == '\n') continue;
+			if(c != '\r') {
+				line += c;
+				continue;
+			}
+			// anything before AT is noise, a half line from a host that gave up
+			size_t at = line.find("AT");
+			if(at == string::npos) at = line.find("at");
+			if(at != string::npos) run_line(line.substr(at));
+			line.clear();
+		}
+	}
+	
+	print_summary();
+	unlink(link);
+	close(slave);
+	close(master);
+	return 0;
+}
+
+double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Time n bytes take on the UART, at the rate the host set on the port (8N1, 10 bits a byte)
+void pace(size_t n)
+{
+	struct termios t;
+	int rate = 115200;
+	
+	if(0 == tcgetattr(master, &t)) {
+		switch(cfgetospeed(&t)) {
+		case B9600:   rate = 9600;   break;
+		case B19200:  rate = 19200;  break;
+		case B38400:  rate = 38400;  break;
+		case B57600:  rate = 57600;  break;
+		case B230400: rate = 230400; break;
+		case B460800: rate = 460800; break;
+		default:      rate = 115200; break;
+		}
+	}
+	usleep(n * 10 * 1000000LL / rate);
+}
+
+// To the host, all of it, at the UART's pace
+void emit(const string &s)
+{
+	size_t done = 0;
+	
+	while(done < s.size()) {
+		ssize_t n = write(master, s.data() + done, s.size() - done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) {
+			perror("Write Error  !!!! ");
+			return;
+		}
+		done += n;
+	}
+	pace(s.size());
+}
+
+// A result code or URC, lost now and then when asked to
+void reply(const string &s)
+{
+	if(rand() % 10000 < shape.drop * 100) {
+		cout << "  (lost " << s << ")" << endl;
+		return;
+	}
+	emit("\r\n" + s + "\r\n");
+}
+
+// n network round trips
+void net_wait(double n)
+{
+	double t = n * shape.rtt + shape.jitter * (2.0 * rand() / RAND_MAX - 1);
+	if(t > 0) usleep(t * 1000000);
+}
+
+bool net_fails()
+{
+	return rand() % 10000 < shape.error * 100;
+}
+
+// Exactly n bytes of data from the host, -1 if they don't come within data_timeout
+int read_data(size_t n, string *out)
+{
+	char buf[1024];
+	
+	out->clear();
+	while(out->size() < n) {
+		struct pollfd pfd = {master, POLLIN, 0};
+		if(poll(&pfd, 1, data_timeout * 1000) <= 0) return -1;
+		ssize_t got = read(master, buf, min(sizeof(buf), n - out->size()));
+		if(got < 0 && errno == EINTR) continue;
+		if(got <= 0) return -1;
+		pace(got);
+		out->append(buf, got);
+	}
+	return 0;
+}
+
+// The +FTPPUT: 1,1,<max> of the last chunk: the modem is ready for more. When it is due,
+// or now with force, held back or not.
+void send_grant(bool force)
+{
+	if(grant_at == 0 || (!force && (grant_late || now() < grant_at))) return;
+	grant_at = 0;
+	reply("+FTPPUT: 1,1," + to_string(ftp_max_len));
+}
+
+// Data going out over the network: the modem's buffer drains at the uplink rate
+static void net_send(size_t n)
+{
+	net_free = max(net_free, now()) + n / shape.rate;
+}
+
+static void net_drain()
+{
+	double t = net_free - now();
+	if(t > 0) usleep(t * 1000000);
+}
+
+// Phase of the command about to run, time so far goes to the one before
+static void enter_phase(int phase)
+{
+	double t = now();
+	
+	if(cur.active) cur.phase[cur_phase] += t - phase_since;
+	else if(phase != PH_OTHER) {
+		cur.active = true;
+		cur.name.clear();
+		cur.bytes = 0;
+		cur.start = t;
+		cur.round_trips = 0;
+		for(int i = 0; i < PH_COUNT; i++) cur.phase[i] = 0;
+	}
+	if(cur.active) cur.round_trips++;
+	cur_phase = phase;
+	phase_since = t;
+}
+
+// One command line: AT, then ';' separated commands run in turn. The first that fails
+// ends the line with ERROR, otherwise one OK ends it.
+void run_line(const string &line)
+{
+	vector<string> cmds;
+	string part;
+	bool quoted = false;
+	
+	cout << line << endl;
+	for(size_t i = 2; i <= line.size(); i++) {
+		if(i == line.size() || (line[i] == ';' && !quoted)) {
+			cmds.push_back(part);
+			part.clear();
+			continue;
+		}
+		if(line[i] == '"') quoted = !quoted;
+		part += line[i];
+	}
+	
+	for(size_t i = 0; i < cmds.size(); i++) {
+		const string &c = cmds[i];
+		size_t end = c.find_first_of("=?");
+		string cmd = c.substr(0, end), args = (end == string::npos) ? "" : c.substr(end);
+		if(cmd.size() > 1 && (cmd[0] == 'E' || cmd[0] == 'e')) {		// ATE0 / ATE1
+			args = "=" + cmd.substr(1);
+			cmd = "E";
+		}
+	
+		const at_handler *h = NULL;
+		for(size_t k = 0; k < sizeof(handlers) / sizeof(handlers[0]) && !h; k++)
+			if(0 == strcasecmp(cmd.c_str(), handlers[k].name)) h = &handlers[k];
+		if(!h) {
+			reply("ERROR");
+			return;
+		}
+	
+		int phase = h->phase;
+		if(h->run == at_ftpput) phase = (args == "=1") ? PH_OPEN : (args == "=2,0") ? PH_CLOSE : PH_DATA;
+		enter_phase(phase);
+	
+		// args without the '='
+		int st = h->run(args.empty() ? args : args.substr(1));
+		if(st == ST_ERROR) {
+			reply("ERROR");
+			return;
+		}
+		if(st == ST_DONE) return;
+	}
+	reply("OK");
+}
+
+int at_ok(const string &)
+{
+	return ST_OK;
+}
+
+int at_echo(const string &args)
+{
+	echo = (args != "0");
+	return ST_OK;
+}
+
+int at_csq(const string &)
+{
+	reply("+CSQ: 18,0");
+	return ST_OK;
+}
+
+// AT+CMGS="<number>" / AT+CMGSEX=..: prompt, the text up to Ctrl-Z, then the network
+int at_sms(const string &args)
+{
+	string text;
+	char c;
+	
+	emit("\r\n> ");
+	for(;;) {
+		struct pollfd pfd = {master, POLLIN, 0};
+		if(poll(&pfd, 1, data_timeout * 1000) <= 0 || read(master, &c, 1) != 1) return ST_DONE;
+		pace(1);
+		if(c == 0x1A) break;
+		if(c == 0x1B) return ST_OK;		// cancelled
+		text += c;
+	}
+	cout << "SMS to " << args << ": " << text << endl;
+	net_wait(1);
+	if(net_fails()) {
+		reply("+CMS ERROR: 500");
+		return ST_DONE;
+	}
+	reply("+CMGS: " + to_string(++sms_ref % 256));
+	return ST_OK;
+}
+
+// AT+SAPBR=<cmd>,1: 3 parameters, 1 open, 0 close, 2 query
+int at_sapbr(const string &args)
+{
+	int cmd = atoi(args.c_str());
+	
+	if(cmd == 1) {
+		net_wait(2);
+		if(net_fails()) return ST_ERROR;
+		bearer = 1;
+	}
+	else if(cmd == 0) {
+		if(!bearer) return ST_ERROR;
+		bearer = 0;
+		ftp_session = 0;
+		grant_at = 0;
+	}
+	else if(cmd == 2) reply(bearer ? "+SAPBR: 1,1,\"" + string(ip_address) + "\"" : "+SAPBR: 1,3,\"0.0.0.0\"");
+	return ST_OK;
+}
+
+int at_ftp_param(const string &)
+{
+	return ST_OK;
+}
+
+static string unquote(const string &s)
+{
+	size_t a = s.find('"'), b = s.rfind('"');
+	return (a == string::npos || b == a) ? s : s.substr(a + 1, b - a - 1);
+}
+
+int at_ftpputname(const string &args)
+{
+	put_name = unquote(args);
+	return ST_OK;
+}
+
+int at_ftpgetname(const string &args)
+{
+	get_name = unquote(args);
+	return ST_OK;
+}
+
+int at_ftpputopt(const string &args)
+{
+	put_appe = (unquote(args) == "APPE");
+	return ST_OK;
+}
+
+// AT+FTPPUT=1 opens the session, =2,<n> sends n bytes, =2,0 closes it
+int at_ftpput(const string &args)
+{
+	int mode = 0, len = -1;
+	sscanf(args.c_str(), "%d,%d", &mode, &len);
+	
+	if(mode == 1) {
+		grant_at = 0;
+		if(!bearer) return ST_ERROR;
+		reply("OK");
+		net_wait(3);				// login, PASV, STOR / APPE
+		if(net_fails()) {
+			reply("+FTPPUT: 1,66");
+			return ST_DONE;
+		}
+		if(!put_appe) server[put_name].clear();
+		ftp_session = 1;
+		cur.name = put_name;
+		reply("+FTPPUT: 1,1," + to_string(ftp_max_len));
+		return ST_DONE;
+	}
+	if(mode != 2 || !ftp_session) return ST_ERROR;
+	
+	if(len == 0) {
+		net_drain();
+		bool late = grant_late;
+		if(!late) send_grant(true);
+		net_wait(1);
+		reply("OK");
+		if(late) send_grant(true);		// a SIM800 does this now and then
+		reply("+FTPPUT: 1,0");
+		ftp_session = 0;
+		upload_done();
+		return ST_DONE;
+	}
+	
+	// the grant comes once what the modem holds has gone out
+	net_drain();
+	send_grant(true);
+	if(net_fails()) {
+		reply("+FTPPUT: 1,61");		// net error, the session is gone
+		ftp_session = 0;
+		return ST_DONE;
+	}
+	len = min(len, ftp_max_len);
+	reply("+FTPPUT: 2," + to_string(len));
+	
+	string data;
+	if(-1 == read_data(len, &data)) {
+		ftp_session = 0;
+		grant_at = 0;
+		return ST_DONE;
+	}
+	server[put_name] += data;
+	cur.bytes += data.size();
+	net_send(data.size());
+	
+	// ready for more once that has gone out, after the OK
+	grant_at = net_free;
+	grant_late = rand() % 10000 < shape.late * 100;
+	return ST_OK;
+}
+
+int at_ftpsize(const string &)
+{
+	reply("OK");
+	net_wait(2);
+	map<string, string>::iterator it = server.find(get_name);
+	if(it == server.end()) reply("+FTPSIZE: 1,66,0");
+	else reply("+FTPSIZE: 1,0," + to_string(it->second.size()));
+	return ST_DONE;
+}
+
+int at_cipshut(const string &)
+{
+	ip_state = "IP INITIAL";
+	reply("SHUT OK");
+	return ST_DONE;
+}
+
+int at_cstt(const string &)
+{
+	ip_state = "IP START";
+	return ST_OK;
+}
+
+int at_ciicr(const string &)
+{
+	net_wait(2);
+	if(net_fails()) return ST_ERROR;
+	ip_state = "IP GPRSACT";
+	return ST_OK;
+}
+
+// the IP address alone, no OK
+int at_cifsr(const string &)
+{
+	ip_state = "IP STATUS";
+	reply(ip_address);
+	return ST_DONE;
+}
+
+// AT+CIPSTART="TCP","host",port in transparent mode: CONNECT, then "<name> <size>\n" and the
+// data straight from the port; the receiver closes once it has all of it
+int at_cipstart(const string &)
+{
+	string hdr, data;
+	char c;
+	char name[256];
+	size_t size = 0;
+	
+	reply("OK");
+	net_wait(1.5);
+	if(net_fails()) {
+		reply("CONNECT FAIL");
+		return ST_DONE;
+	}
+	reply("CONNECT");
+	
+	while(hdr.size() < 300) {
+		struct pollfd pfd = {master, POLLIN, 0};
+		if(poll(&pfd, 1, data_timeout * 1000) <= 0 || read(master, &c, 1) != 1) return ST_DONE;
+		pace(1);
+		if(c == '\n') break;
+		hdr += c;
+	}
+	if(2 != sscanf(hdr.c_str(), "%255s %zu", name, &size)) {
+		reply("CLOSED");
+		return ST_DONE;
+	}
+	cur.name = name;
+	
+	// the modem forwards as it receives, at most the uplink rate
+	while(data.size() < size) {
+		string chunk;
+		if(-1 == read_data(min((size_t)ftp_max_len, size - data.size()), &chunk)) return ST_DONE;
+		data += chunk;
+		cur.bytes += chunk.size();
+		net_send(chunk.size());
+		net_drain();
+	}
+	server[name] = data;
+	
+	enter_phase(PH_CLOSE);
+	net_wait(1);
+	reply("CLOSED");
+	upload_done();
+	return ST_DONE;
+}
+
+int at_cipstatus(const string &)
+{
+	reply("OK");
+	reply("STATE: " + ip_state);
+	return ST_DONE;
+}
+
+// AT+HTTPPARA="URL","...?name=<name>"
+int at_httppara(const string &args)
+{
+	size_t p = args.find("name=");
+	if(0 == args.compare(0, 5, "\"URL\"") && p != string::npos) http_name = args.substr(p + 5, args.find('"', p) - p - 5);
+	return ST_OK;
+}
+
+// AT+HTTPDATA=<size>,<ms>: DOWNLOAD, then the body
+int at_httpdata(const string &args)
+{
+	size_t size = atol(args.c_str());
+	
+	reply("DOWNLOAD");
+	if(-1 == read_data(size, &http_body)) return ST_ERROR;
+	cur.bytes += http_body.size();
+	return ST_OK;
+}
+
+// AT+HTTPACTION=1: OK, and the status once the POST went through
+int at_httpaction(const string &)
+{
+	reply("OK");
+	net_send(http_body.size());
+	net_drain();
+	net_wait(2);
+	if(net_fails()) reply("+HTTPACTION: 1,601,0");
+	else {
+		server[http_name] = http_body;
+		cur.name = http_name;
+		reply("+HTTPACTION: 1,200,0");
+	}
+	upload_done();
+	return ST_DONE;
+}
+
+int at_attach(const string &)
+{
+	net_wait(1);
+	return net_fails() ? ST_ERROR : ST_OK;
+}
+
+// AT+CGPSINF=32, an RMC fix
+int at_cgpsinf(const string &)
+{
+	reply("32,061530.000,A,1258.6230,N,07738.2120,E,0.12,84.50,181026,,,A");
+	return ST_OK;
+}
+
+// The upload in progress is over, one line for it
+void upload_done()
+{
+	if(!cur.active) return;
+	enter_phase(PH_OTHER);
+	cur.active = false;
+	
+	double secs = now() - cur.start;
+	printf("%s: %zu bytes in %.1f s, %.0f bytes/s, %ld round trips (", cur.name.c_str(), cur.bytes, secs,
+	       secs > 0 ? cur.bytes / secs : 0, cur.round_trips);
+	for(int i = 0; i < PH_OTHER; i++) printf("%s%s %.1f s", i ? ", " : "", phase_names[i], cur.phase[i]);
+	printf(")\n");
+	fflush(stdout);
+	
+	for(size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++) {
+		if(cur.bytes >= buckets[i].below) continue;
+		buckets[i].files++;
+		buckets[i].bytes += cur.bytes;
+		buckets[i].seconds += secs;
+		buckets[i].round_trips += cur.round_trips;
+		break;
+	}
+	
+	if(keep_dir && !cur.name.empty() && server.count(cur.name)) {
+		string path = string(keep_dir) + "/" + cur.name;
+		FILE *f = fopen(path.c_str(), "wb");
+		if(f) {
+			if(fwrite(server[cur.name].data(), 1, server[cur.name].size(), f) != server[cur.name].size()) perror("write error  !!!! ");
+			fclose(f);
+		}
+		else perror("open error  !!!! ");
+	}
+}
+
+void print_summary()
+{
+	cout << endl << "size        files      bytes/s   round trips/file   s/file" << endl;
+	for(size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++) {
+		const size_bucket &b = buckets[i];
+		if(!b.files) continue;
+		printf("%-10s %6ld %12.0f %18.1f %8.1f\n", b.label, b.files, b.seconds > 0 ? b.bytes / b.seconds : 0,
+		       (double)b.round_trips / b.files, b.seconds / b.files);
+	}
+}
+
+// The whole trace file, magic checked. Traces are a few MB at most.
+int load_trace(const char *path, string *data)
+{
+	char buf[4096];
+	FILE *f = fopen(path, "rb");
+	
+	if(!f) {
+		perror("trace open error  !!!! ");
+		return -1;
+	}
+	data->clear();
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) data->append(buf, n);
+	fclose(f);
+	if(0 != data->compare(0, sizeof(trace_magic) - 1, trace_magic)) {
+		cerr << path << ": not a serial trace" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+// Bytes as C string literal text, CR LF and the binary escaped
+string printable(const char *p, size_t n)
+{
+	string s;
+	char hex[8];
+	
+	for(size_t i = 0; i < n; i++) {
+		unsigned char c = p[i];
+		if(c == '\r') s += "\\r";
+		else if(c == '\n') s += "\\n";
+		else if(c == '\\' || c == '"') s += string("\\") + (char)c;
+		else if(c >= ' ' && c < 0x7F) s += c;
+		else {
+			snprintf(hex, sizeof(hex), "\\x%02X", c);
+			s += hex;
+		}
+	}
+	return s;
+}
+
+// A line per record: seconds from the first, direction, the bytes (data cut at 80)
+int dump_trace(const char *path)
+{
+	string data;
+	size_t pos = sizeof(trace_magic) - 1;
+	uint32_t first = 0;
+	
+	if(-1 == load_trace(path, &data)) return -1;
+	for(bool start = true; pos + sizeof(trace_rec) <= data.size(); start = false) {
+		trace_rec r;
+		memcpy(&r, data.data() + pos, sizeof(r));
+		pos += sizeof(r);
+		if(pos + r.len > data.size()) break;
+		if(start) first = r.ms;
+	
+		size_t shown = min((size_t)r.len, (size_t)80);
+		printf("%10.3f %s \"%s\"%s\n", (uint32_t)(r.ms - first) / 1000.0, r.dir == TRACE_RX ? "modem" : "host ",
+		       printable(data.data() + pos, shown).c_str(), shown < r.len ? " .." : "");
+		if(shown < r.len) printf("%17s(%u bytes)\n", "", r.len);
+		pos += r.len;
+	}
+	if(pos != data.size()) cerr << path << ": cut short at byte " << pos << endl;
+	return 0;
+}
+
+// Plays a trace back to the host: the modem's records go out when they are due, at the
+// recorded gaps divided by speed, and the host's records are waited for and compared with
+// what the host actually sends. Every host record puts the clock back in step, so the replies
+// keep their recorded delay after the command whatever the host's own pace. A host that
+// doesn't send within data_timeout is reported and the trace goes on.
+int replay_trace(const char *path, double speed)
+{
+	string data, got;
+	size_t pos = sizeof(trace_magic) - 1;
+	size_t to_host = 0, from_host = 0;
+	long   records = 0, diffs = 0;
+	double base = now();
+	uint32_t base_ms = 0;
+	
+	if(-1 == load_trace(path, &data)) return -1;
+	while(!stop && pos + sizeof(trace_rec) <= data.size()) {
+		trace_rec r;
+		memcpy(&r, data.data() + pos, sizeof(r));
+		pos += sizeof(r);
+		if(pos + r.len > data.size()) break;
+		const char *p = data.data() + pos;
+		pos += r.len;
+		if(records++ == 0) base_ms = r.ms;
+	
+		if(r.dir == TRACE_RX) {
+			double wait = speed > 0 ? base + (uint32_t)(r.ms - base_ms) / 1000.0 / speed - now() : 0;
+			if(wait > 0) usleep(wait * 1000000);
+			emit(string(p, r.len));
+			to_host += r.len;
+			continue;
+		}
+	
+		if(-1 == read_data(r.len, &got)) {
+			cout << "  host silent, the trace has \"" << printable(p, r.len) << "\"" << endl;
+			diffs++;
+		}
+		else if(0 != got.compare(0, string::npos, p, r.len)) {
+			cout << "  host sent \"" << printable(got.data(), got.size()) << "\", the trace has \"" << printable(p, r.len) << "\"" << endl;
+			diffs++;
+		}
+		from_host += got.size();
+		base = now();
+		base_ms = r.ms;
+	}
+	
+	cout << records << " records played back, " << to_host << " bytes to the host, " << from_host
+	     << " from it, " << diffs << " differences" << endl;
+	return diffs ? 1 : 0;
+}